@@ -1,4 +1,5 @@
 // clang-format off
+#include <cstdlib>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
@@ -31,7 +32,7 @@ Eigen::Matrix4f get_model_matrix(float rotation_angle)
 Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio, float zNear, float zFar)
 {
     // TODO: Copy-paste your implementation from the previous assignment.
-    Eigen::Matrix4f projection;
+    Eigen::Matrix4f projection = Eigen::Matrix4f::Identity();
 
     float n = -zNear;
     float f = -zFar;
@@ -78,11 +79,26 @@ int main(int argc, const char** argv)
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
+    int msaa = 1;
 
-    if (argc == 2)
+    // Usage: Rasterizer [--msaa samples] [output.png]
+    for (int i = 1; i < argc; ++i)
     {
-        command_line = true;
-        filename = std::string(argv[1]);
+        std::string arg = argv[i];
+        if (arg == "--msaa" && i + 1 < argc)
+        {
+            msaa = std::atoi(argv[++i]);
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            std::cerr << "Unknown or incomplete option " << arg << std::endl;
+            return 1;
+        }
+        else
+        {
+            command_line = true;
+            filename = arg;
+        }
     }
 
     rst::rasterizer r(700, 700);
@@ -119,7 +135,7 @@ int main(int argc, const char** argv)
     auto pos_id = r.load_positions(pos);
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
-    //r.setSSAA(true);
+    r.setMSAA(msaa);
 
     int key = 0;
     int frame_count = 0;
@@ -40,6 +40,33 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
+// Sample positions inside the pixel for 2x, 4x, 8x and 16x MSAA, the
+// standard rotated grid patterns given in 1/16 pixel units around the center
+static const Eigen::Vector2f* samplePattern(int samples)
+{
+    static const auto pattern = [](std::initializer_list<std::pair<int, int>> offsets) {
+        std::vector<Eigen::Vector2f> points;
+        for (auto [dx, dy] : offsets)
+            points.emplace_back(0.5f + dx / 16.f, 0.5f + dy / 16.f);
+        return points;
+    };
+    static const std::vector<Eigen::Vector2f> msaa2 = pattern({{4, 4}, {-4, -4}});
+    static const std::vector<Eigen::Vector2f> msaa4 = pattern({{-2, -6}, {6, -2}, {-6, 2}, {2, 6}});
+    static const std::vector<Eigen::Vector2f> msaa8 = pattern({{1, -3}, {-1, 3}, {5, 1}, {-3, -5},
+                                                               {-5, 5}, {-7, -1}, {3, 7}, {7, -7}});
+    static const std::vector<Eigen::Vector2f> msaa16 = pattern({{1, 1}, {-1, -3}, {-3, 2}, {4, -1},
+                                                                {-5, -2}, {2, 5}, {5, 3}, {3, -5},
+                                                                {-2, 6}, {0, -7}, {-4, -6}, {-6, 4},
+                                                                {-8, 0}, {7, -4}, {6, 7}, {-7, -8}});
+    switch (samples) {
+        case 2: return msaa2.data();
+        case 4: return msaa4.data();
+        case 8: return msaa8.data();
+        case 16: return msaa16.data();
+        default: return nullptr;
+    }
+}
+
 static bool insideTriangle(float x, float y, const Vector3f* _v)
 {   
     // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
@@ -58,6 +85,69 @@ static std::tuple<float, float, float> computeBarycentric2D(float x, float y, co
     return {c1,c2,c3};
 }
 
+// A vertex of the clipping stage, in clip space
+struct ClipVertex
+{
+    Eigen::Vector4f pos;
+    Eigen::Vector3f color;
+};
+
+// Signed distance to the planes x = -w, x = w, y = -w, y = w, z = -w and
+// z = w, positive inside the view volume
+static float clipDistance(const Eigen::Vector4f& p, int plane)
+{
+    float d = plane & 1 ? -p[plane >> 1] : p[plane >> 1];
+    return p.w() + d;
+}
+
+// Clips the triangle in v[0..2] against the view volume in place. Every
+// plane adds at most one vertex, so v holds up to 9. Returns the vertex
+// count of the clipped polygon.
+static int clipPolygon(ClipVertex* v)
+{
+    int outside = 0, outsideAll = 0x3f;
+    for (int j = 0; j < 3; ++j)
+    {
+        int code = 0;
+        for (int plane = 0; plane < 6; ++plane)
+            if (clipDistance(v[j].pos, plane) < 0)
+                code |= 1 << plane;
+        outside |= code;
+        outsideAll &= code;
+    }
+    if (outsideAll)
+        return 0;
+
+    int n = 3;
+    ClipVertex clipped[9];
+    for (int plane = 0; plane < 6 && n >= 3; ++plane)
+    {
+        if (!(outside & (1 << plane)))
+            continue;
+        int m = 0;
+        for (int k = 0; k < n; ++k)
+        {
+            const ClipVertex& a = v[k];
+            const ClipVertex& b = v[(k + 1) % n];
+            float da = clipDistance(a.pos, plane);
+            float db = clipDistance(b.pos, plane);
+            if (da >= 0)
+                clipped[m++] = a;
+            if ((da >= 0) != (db >= 0))
+            {
+                float t = da / (da - db);
+                clipped[m].pos = a.pos + t * (b.pos - a.pos);
+                // Kept in [0, 255] for Triangle::setColor despite rounding
+                clipped[m].color = (a.color + t * (b.color - a.color)).cwiseMax(0.f).cwiseMin(255.f);
+                ++m;
+            }
+        }
+        std::copy(clipped, clipped + m, v);
+        n = m;
+    }
+    return n;
+}
+
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
     auto& buf = pos_buf[pos_buffer.pos_id];
@@ -68,43 +158,75 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
     float f2 = (50 + 0.1) / 2.0;
 
     Eigen::Matrix4f mvp = projection * view * model;
+
+    // The clipper assumes w > 0 in front of the camera. Projections that
+    // map the visible side to w < 0 have their clip coordinates negated,
+    // which is the same homogeneous point.
+    float w_sign = projection(3, 2) < 0 ? 1.f : -1.f;
+
     for (auto& i : ind)
     {
-        Triangle t;
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
-        }
-        //Viewport transformation
-        for (auto & vert : v)
+        ClipVertex v[9];
+        for (int j = 0; j < 3; ++j)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            v[j].pos = w_sign * (mvp * to_vec4(buf[i[j]], 1.0f));
+            v[j].color = col[i[j]];
         }
 
-        for (int i = 0; i < 3; ++i)
+        // Sutherland-Hodgman clipping against the view volume, then
+        // the polygon is fanned back into triangles
+        int n = clipPolygon(v);
+        if (n < 3)
+            continue;
+
+        for (int k = 0; k < n; ++k)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            Eigen::Vector4f& vec = v[k].pos;
+            //Homogeneous division
+            vec /= vec.w();
+            //Viewport transformation
+            vec.x() = 0.5*width*(vec.x()+1.0);
+            vec.y() = 0.5*height*(vec.y()+1.0);
+            vec.z() = vec.z() * f1 + f2;
         }
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+        for (int k = 1; k + 1 < n; ++k)
+        {
+            const ClipVertex* tv[] = {&v[0], &v[k], &v[k + 1]};
+
+            float area = (tv[1]->pos.x() - tv[0]->pos.x()) * (tv[2]->pos.y() - tv[0]->pos.y()) -
+                         (tv[2]->pos.x() - tv[0]->pos.x()) * (tv[1]->pos.y() - tv[0]->pos.y());
+            if (area == 0 || (_cullBackfaces && area < 0))
+                continue;
+
+            Triangle t;
+            for (int j = 0; j < 3; ++j)
+            {
+                t.setVertex(j, tv[j]->pos.head<3>());
+                t.setColor(j, tv[j]->color[0], tv[j]->color[1], tv[j]->color[2]);
+            }
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+            rasterize_triangle(t);
+        }
+    }
+
+    if (msaa_samples > 1)
+        resolve();
+}
 
-        rasterize_triangle(t);
+// Averages the sample planes into frame_buf, one plane at a time
+void rst::rasterizer::resolve()
+{
+    int plane_size = width * height;
+    std::copy(sample_frame_buf.begin(), sample_frame_buf.begin() + plane_size, frame_buf.begin());
+    for (int s = 1; s < msaa_samples; ++s) {
+        const Eigen::Vector3f* plane = &sample_frame_buf[s * plane_size];
+        for (int i = 0; i < plane_size; ++i)
+            frame_buf[i] += plane[i];
     }
+    float weight = 1.f / msaa_samples;
+    for (auto& color : frame_buf)
+        color *= weight;
 }
 
 //Screen space rasterization
@@ -137,40 +259,32 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     maxY = MIN(height - 1, maxY);
     for (int x = minX; x <= maxX; x++) {
         for (int y = minY; y <= maxY; y++) {
-            if (_isSSAA) {
+            if (msaa_samples > 1) {
+                // Coverage and depth are tested per sample, but the color is
+                // computed once per pixel and stored in every sample it wins
                 int idx = get_index(x, y);
-                if (SSAA_depth_buf[idx].empty()) {
-                    SSAA_depth_buf[idx].resize(4, std::numeric_limits<float>::infinity());
-                    SSAA_frame_buf[idx].resize(4, Eigen::Vector3f{ 0, 0, 0 });
-                }
-                int subIdx = 0;
-                Vector3f color(0, 0, 0);
-                for (float x_ = 0.25; x_ < 1; x_ += 0.5) {
-                    for (float y_ = 0.25; y_ < 1; y_ += 0.5) {
-                        if (insideTriangle(x + x_, y + y_, t.v)) {
-                            auto data = computeBarycentric2D(x+x_, y+y_, t.v);
-                            float alpha = std::get<0>(data);
-                            float beta = std::get<1>(data);
-                            float gamma = std::get<2>(data);
-                            float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                            float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                            z_interpolated *= w_reciprocal;
-                            if (z_interpolated < SSAA_depth_buf[idx][subIdx]) {
-                                SSAA_depth_buf[idx][subIdx] = z_interpolated;
-                                SSAA_frame_buf[idx][subIdx] = t.getColor();
-                                color += t.getColor();
-                            }
-                            else {
-                                color += SSAA_frame_buf[idx][subIdx];
-                            }
-                        }
-                        else {
-                            color += SSAA_frame_buf[idx][subIdx];
+                int plane_size = width * height;
+                bool shaded = false;
+                Eigen::Vector3f color = Eigen::Vector3f::Zero();
+                for (int s = 0; s < msaa_samples; ++s) {
+                    float sx = x + sample_pattern[s].x();
+                    float sy = y + sample_pattern[s].y();
+                    if (!insideTriangle(sx, sy, t.v))
+                        continue;
+                    auto [alpha, beta, gamma] = computeBarycentric2D(sx, sy, t.v);
+                    float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+                    z_interpolated *= w_reciprocal;
+                    float& depth = sample_depth_buf[s * plane_size + idx];
+                    if (z_interpolated < depth) {
+                        depth = z_interpolated;
+                        if (!shaded) {
+                            color = t.getColor();
+                            shaded = true;
                         }
-                        subIdx++;
+                        sample_frame_buf[s * plane_size + idx] = color;
                     }
                 }
-                set_pixel(Vector3f(x, y, 1), color / 4);
             }
             else {
                 if (insideTriangle(x+0.5, y+0.5, t.v)) {
@@ -212,16 +326,12 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
-        for (auto buffs : SSAA_frame_buf) {
-            std::fill(buffs.begin(), buffs.end(), Eigen::Vector3f{ 0, 0, 0 });
-        }
+        std::fill(sample_frame_buf.begin(), sample_frame_buf.end(), Eigen::Vector3f{0, 0, 0});
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
-        for (auto buffs : SSAA_depth_buf) {
-            std::fill(buffs.begin(), buffs.end(), std::numeric_limits<float>::infinity());
-        }
+        std::fill(sample_depth_buf.begin(), sample_depth_buf.end(), std::numeric_limits<float>::infinity());
     }
 }
 
@@ -229,8 +339,19 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
-    SSAA_frame_buf.resize(w * h);
-    SSAA_depth_buf.resize(w * h);
+}
+
+void rst::rasterizer::setMSAA(int samples)
+{
+    msaa_samples = 1;
+    for (int supported : {2, 4, 8, 16})
+        if (samples >= supported)
+            msaa_samples = supported;
+    sample_pattern = samplePattern(msaa_samples);
+
+    int plane_size = msaa_samples > 1 ? width * height : 0;
+    sample_frame_buf.assign(msaa_samples * plane_size, Eigen::Vector3f{0, 0, 0});
+    sample_depth_buf.assign(msaa_samples * plane_size, std::numeric_limits<float>::infinity());
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -74,14 +74,22 @@ namespace rst
 
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
-        void setSSAA(bool isSSAA) { _isSSAA = isSSAA; }
+        // Multisampling with 1 (off), 2, 4, 8 or 16 samples per pixel. Other
+        // counts are rounded down to the nearest supported one.
+        void setMSAA(int samples);
+
+        // Drops triangles that are clockwise on screen, i.e. facing away
+        // from the camera for counter clockwise meshes
+        void setCullBackfaces(bool cull) { _cullBackfaces = cull; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
         void rasterize_triangle(const Triangle& t);
 
-        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
+        void resolve();
+
+        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> Culling -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
         Eigen::Matrix4f model;
@@ -96,8 +104,12 @@ namespace rst
 
         std::vector<float> depth_buf;
 
-        std::vector<std::vector<Eigen::Vector3f>> SSAA_frame_buf;
-        std::vector<std::vector<float>> SSAA_depth_buf;
+        // MSAA sample buffers, one width * height plane per sample stored
+        // back to back; draw() resolves them into frame_buf
+        int msaa_samples = 1;
+        const Eigen::Vector2f* sample_pattern = nullptr;
+        std::vector<Eigen::Vector3f> sample_frame_buf;
+        std::vector<float> sample_depth_buf;
         int get_index(int x, int y);
 
         int width, height;
@@ -105,6 +117,6 @@ namespace rst
         int next_id = 0;
         int get_next_id() { return next_id++; }
 
-        bool _isSSAA = false;
+        bool _cullBackfaces = false;
     };
 }
@@ -23,9 +23,36 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
+    // Change of tex_coords per pixel along screen x and y, for mip selection
+    Eigen::Vector2f tex_coords_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_coords_dy = Eigen::Vector2f::Zero();
     Texture* texture;
 };
 
+// Fragment attributes a shader reads. The templated rasterizer path only
+// interpolates the ones in Shader::attributes.
+enum fragment_attributes : unsigned
+{
+    attr_color = 1,
+    attr_normal = 2,
+    attr_tex_coords = 4,
+    attr_view_pos = 8,
+    attr_all = attr_color | attr_normal | attr_tex_coords | attr_view_pos
+};
+
+// A fragment shader bound at compile time, e.g.
+// static_shader<phong_fragment_shader, attr_color | attr_normal | attr_view_pos>
+template <Eigen::Vector3f (*Func)(const fragment_shader_payload&), unsigned Attributes>
+struct static_shader
+{
+    static constexpr unsigned attributes = Attributes;
+
+    Eigen::Vector3f operator()(const fragment_shader_payload& payload) const
+    {
+        return Func(payload);
+    }
+};
+
 struct vertex_shader_payload
 {
     Eigen::Vector3f position;
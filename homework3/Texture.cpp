@@ -2,3 +2,112 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+#include <cmath>
+
+static uint32_t pack(float r, float g, float b)
+{
+    return (uint32_t)std::lround(r) | (uint32_t)std::lround(g) << 8 | (uint32_t)std::lround(b) << 16;
+}
+
+Texture::Level Texture::makeLevel(int width, int height)
+{
+    Level level;
+    level.width = width;
+    level.height = height;
+    level.tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    level.texels.resize(level.tiles_x * tiles_y * tile_size * tile_size);
+    return level;
+}
+
+Texture::Texture(const std::string& name)
+{
+    cv::Mat image_data = cv::imread(name);
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+    width = image_data.cols;
+    height = image_data.rows;
+
+    Level base = makeLevel(width, height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x) {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            base.at(x, y) = pack(color[0], color[1], color[2]);
+        }
+    levels.push_back(std::move(base));
+
+    // Mip chain down to 1x1, each texel the box filtered 2x2 texels above it
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Level& src = levels.back();
+        Level dst = makeLevel(std::max(1, src.width / 2), std::max(1, src.height / 2));
+        for (int y = 0; y < dst.height; ++y)
+            for (int x = 0; x < dst.width; ++x) {
+                int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                Eigen::Vector3f sum = fetch(src, x0, y0) + fetch(src, x1, y0) + fetch(src, x0, y1) + fetch(src, x1, y1);
+                sum /= 4;
+                dst.at(x, y) = pack(sum.x(), sum.y(), sum.z());
+            }
+        levels.push_back(std::move(dst));
+    }
+}
+
+Eigen::Vector3f Texture::getColorBilinear(float u, float v, int lod) const
+{
+    const Level& level = levels[std::clamp(lod, 0, (int)levels.size() - 1)];
+    float x = u * level.width - 0.5f;
+    float y = (1 - v) * level.height - 0.5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float s = x - fx, t = y - fy;
+    int x0 = std::clamp((int)fx, 0, level.width - 1), x1 = std::clamp((int)fx + 1, 0, level.width - 1);
+    int y0 = std::clamp((int)fy, 0, level.height - 1), y1 = std::clamp((int)fy + 1, 0, level.height - 1);
+    Eigen::Vector3f top = fetch(level, x0, y0) * (1 - s) + fetch(level, x1, y0) * s;
+    Eigen::Vector3f bottom = fetch(level, x0, y1) * (1 - s) + fetch(level, x1, y1) * s;
+    return top * (1 - t) + bottom * t;
+}
+
+Eigen::Vector3f Texture::getColorTrilinear(float u, float v, float lod) const
+{
+    lod = std::clamp(lod, 0.f, (float)levels.size() - 1);
+    int lower = (int)lod;
+    float t = lod - lower;
+    Eigen::Vector3f color = getColorBilinear(u, v, lower);
+    if (t > 0)
+        color = color * (1 - t) + getColorBilinear(u, v, lower + 1) * t;
+    return color;
+}
+
+Eigen::Vector3f Texture::sample(const Eigen::Vector2f& uv, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+{
+    // Pixel footprint axes in texels of the full size level
+    Eigen::Vector2f dx(duv_dx.x() * width, duv_dx.y() * height);
+    Eigen::Vector2f dy(duv_dy.x() * width, duv_dy.y() * height);
+    float len_x = dx.norm(), len_y = dy.norm();
+
+    switch (filter) {
+        case Filter::Nearest:
+            return getColor(uv.x(), uv.y());
+        case Filter::Bilinear:
+            return getColorBilinear(uv.x(), uv.y());
+        case Filter::Trilinear:
+            return getColorTrilinear(uv.x(), uv.y(), std::log2(std::max({len_x, len_y, 1e-8f})));
+        case Filter::Anisotropic:
+        default:
+        {
+            // Several trilinear probes spread along the major axis, each
+            // filtered for the minor axis, instead of one blurred probe
+            float major = std::max(len_x, len_y), minor = std::min(len_x, len_y);
+            if (major < 1e-8f)
+                return getColorTrilinear(uv.x(), uv.y(), 0);
+            int probes = std::clamp((int)std::ceil(major / std::max(minor, 1e-8f)), 1, max_anisotropy);
+            float lod = std::log2(major / probes);
+            Eigen::Vector2f axis = len_x >= len_y ? duv_dx : duv_dy;
+            Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+            for (int i = 0; i < probes; ++i) {
+                Eigen::Vector2f p = uv + axis * ((i + 0.5f) / probes - 0.5f);
+                sum += getColorTrilinear(p.x(), p.y(), lod);
+            }
+            return sum / probes;
+        }
+    }
+}
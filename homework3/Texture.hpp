@@ -7,32 +7,70 @@
 #include "global.hpp"
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 class Texture{
-private:
-    cv::Mat image_data;
-
 public:
-    Texture(const std::string& name)
+    enum class Filter
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
-    }
+        Nearest,
+        Bilinear,
+        Trilinear,
+        Anisotropic
+    };
+
+    Texture(const std::string& name);
 
     int width, height;
 
-    Eigen::Vector3f getColor(float u, float v)
+    // Used by sample(); getColor() always reads the nearest full size texel
+    Filter filter = Filter::Trilinear;
+    int max_anisotropy = 8;
+
+    Eigen::Vector3f getColor(float u, float v) const
+    {
+        const Level& level = levels[0];
+        int x = std::clamp((int)(u * level.width), 0, level.width - 1);
+        int y = std::clamp((int)((1 - v) * level.height), 0, level.height - 1);
+        return fetch(level, x, y);
+    }
+
+    Eigen::Vector3f getColorBilinear(float u, float v, int lod = 0) const;
+
+    // Filtered lookup at uv, where duv_dx and duv_dy are the change of the
+    // texture coordinates from one pixel to the next along screen x and y
+    Eigen::Vector3f sample(const Eigen::Vector2f& uv, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const;
+
+private:
+    // One mip level. Texels are packed RGB8 in tile_size x tile_size tiles,
+    // so a tile is one 64 byte cache line and filter footprints stay in it.
+    struct Level
+    {
+        int width, height, tiles_x;
+        std::vector<uint32_t> texels;
+
+        uint32_t& at(int x, int y)
+        {
+            return texels[((y / tile_size) * tiles_x + x / tile_size) * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size];
+        }
+        uint32_t at(int x, int y) const
+        {
+            return texels[((y / tile_size) * tiles_x + x / tile_size) * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size];
+        }
+    };
+
+    static constexpr int tile_size = 4;
+    std::vector<Level> levels;
+
+    static Level makeLevel(int width, int height);
+
+    static Eigen::Vector3f fetch(const Level& level, int x, int y)
     {
-        if (u < 0) u = 0;
-        if (v < 0) v = 0;
-        if (u > 1) u = 1;
-        if (v > 1) v = 1;
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        uint32_t texel = level.at(x, y);
+        return Eigen::Vector3f(texel & 0xff, (texel >> 8) & 0xff, (texel >> 16) & 0xff);
     }
 
+    Eigen::Vector3f getColorTrilinear(float u, float v, float lod) const;
 };
 #endif //RASTERIZER_TEXTURE_H
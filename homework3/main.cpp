@@ -1,4 +1,10 @@
 #include <iostream>
+#include <array>
+#include <map>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -96,7 +102,7 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     if (payload.texture)
     {
         // TODO: Get the texture value at the texture coordinates of the current fragment
-        return_color = payload.texture->getColor(payload.tex_coords.x(), payload.tex_coords.y());
+        return_color = payload.texture->sample(payload.tex_coords, payload.tex_coords_dx, payload.tex_coords_dy);
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -304,79 +310,322 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// The shaders above bound at compile time, with the attributes each one reads
+using normal_shader = static_shader<normal_fragment_shader, attr_normal>;
+using texture_shader = static_shader<texture_fragment_shader, attr_normal | attr_tex_coords | attr_view_pos>;
+using phong_shader = static_shader<phong_fragment_shader, attr_color | attr_normal | attr_view_pos>;
+using bump_shader = static_shader<bump_fragment_shader, attr_all>;
+using displacement_shader = static_shader<displacement_fragment_shader, attr_all>;
+
+// Loads an .obj file into indexed buffers. The loader emits every face corner
+// as its own vertex, so corners with the same attributes are welded into
+// shared vertices.
+bool load_mesh(const std::string& path, std::vector<Eigen::Vector3f>& positions, std::vector<Eigen::Vector3f>& normals,
+               std::vector<Eigen::Vector2f>& texcoords, std::vector<Eigen::Vector3i>& indices)
 {
-    std::vector<Triangle*> TriangleList;
-
-    float angle = 140.0;
-    bool command_line = false;
-
-    std::string filename = "output.png";
     objl::Loader Loader;
-    std::string obj_path = "../models/spot/";
-
-    // Load .obj File
-    bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
+    if (!Loader.LoadFile(path))
+        return false;
+    std::map<std::array<float, 8>, int> vertex_ids;
     for(auto mesh:Loader.LoadedMeshes)
     {
         for(int i=0;i<mesh.Vertices.size();i+=3)
         {
-            Triangle* t = new Triangle();
+            Eigen::Vector3i face;
             for(int j=0;j<3;j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const objl::Vertex& vert = mesh.Vertices[i+j];
+                std::array<float, 8> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                            vert.Normal.X, vert.Normal.Y, vert.Normal.Z,
+                                            vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+                auto [it, inserted] = vertex_ids.emplace(key, (int)positions.size());
+                if (inserted)
+                {
+                    positions.emplace_back(vert.Position.X, vert.Position.Y, vert.Position.Z);
+                    normals.emplace_back(vert.Normal.X, vert.Normal.Y, vert.Normal.Z);
+                    texcoords.emplace_back(vert.TextureCoordinate.X, vert.TextureCoordinate.Y);
+                }
+                face[j] = it->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(face);
         }
     }
+    return true;
+}
 
-    rst::rasterizer r(700, 700);
+// Draw call of the named shader on the mesh, empty if there is no such shader
+std::function<void()> shader_draw(rst::rasterizer& r, const std::string& name,
+                                  rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, rst::col_buf_id col_id)
+{
+    if (name == "texture")
+        return [=, &r] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, texture_shader()); };
+    if (name == "normal")
+        return [=, &r] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, normal_shader()); };
+    if (name == "phong")
+        return [=, &r] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, phong_shader()); };
+    if (name == "bump")
+        return [=, &r] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, bump_shader()); };
+    if (name == "displacement")
+        return [=, &r] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, displacement_shader()); };
+    return {};
+}
 
-    auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
+// Timings and counters of one frame of a batch run
+struct frame_record
+{
+    rst::frame_stats stats;
+    double total_ms;
+    long long covered;
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    double overdraw() const { return covered > 0 ? (double)stats.fragments / covered : 0.0; }
+};
 
-    if (argc >= 2)
+// Renders a turntable sequence without a window and reports per frame timings:
+//   Rasterizer --batch [--frames N] [--size WxH] [--shader name] [--deferred]
+//              [--model file.obj] [--texture file] [--angle deg] [--rotate deg]
+//              [--csv file] [--json file] [--output prefix]
+// The model starts at --angle and turns --rotate degrees every frame. With
+// --output every frame is also written to <prefix><frame>.png.
+int run_batch(int argc, const char** argv)
+{
+    int frames = 60;
+    int width = 700, height = 700;
+    std::string shader = "phong";
+    std::string model_path = "../models/spot/spot_triangulated_good.obj";
+    std::string texture_path;
+    std::string csv_path, json_path, output_prefix;
+    float angle = 140.0, rotate = 1.0;
+    bool deferred = false;
+
+    for (int i = 2; i < argc; ++i)
     {
-        command_line = true;
-        filename = std::string(argv[1]);
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--deferred")
+            deferred = true;
+        else if (arg == "--frames" && has_value)
+            frames = std::atoi(argv[++i]);
+        else if (arg == "--size" && has_value)
+        {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2)
+                width = height = 0;
+        }
+        else if (arg == "--shader" && has_value)
+            shader = argv[++i];
+        else if (arg == "--model" && has_value)
+            model_path = argv[++i];
+        else if (arg == "--texture" && has_value)
+            texture_path = argv[++i];
+        else if (arg == "--angle" && has_value)
+            angle = std::atof(argv[++i]);
+        else if (arg == "--rotate" && has_value)
+            rotate = std::atof(argv[++i]);
+        else if (arg == "--csv" && has_value)
+            csv_path = argv[++i];
+        else if (arg == "--json" && has_value)
+            json_path = argv[++i];
+        else if (arg == "--output" && has_value)
+            output_prefix = argv[++i];
+        else
+        {
+            std::cerr << "Unknown or incomplete option " << arg << "\n";
+            return 1;
+        }
+    }
+    if (frames <= 0 || width <= 0 || height <= 0)
+    {
+        std::cerr << "--frames and --size must be positive\n";
+        return 1;
+    }
+
+    std::vector<Eigen::Vector3f> positions;
+    std::vector<Eigen::Vector3f> normals;
+    std::vector<Eigen::Vector2f> texcoords;
+    std::vector<Eigen::Vector3i> indices;
+    if (!load_mesh(model_path, positions, normals, texcoords, indices))
+    {
+        std::cerr << "Cannot load " << model_path << "\n";
+        return 1;
+    }
+    std::vector<Eigen::Vector3f> colors(positions.size(), Eigen::Vector3f(148, 121, 92));
+
+    rst::rasterizer r(width, height);
+    auto pos_id = r.load_positions(positions);
+    auto ind_id = r.load_indices(indices);
+    auto col_id = r.load_colors(colors);
+    r.load_normals(normals);
+    r.load_texcoords(texcoords);
+
+    auto draw = shader_draw(r, shader, pos_id, ind_id, col_id);
+    if (!draw)
+    {
+        std::cerr << "Unknown shader " << shader << "\n";
+        return 1;
+    }
+    if (texture_path.empty())
+        texture_path = std::string("../models/spot/") + (shader == "texture" ? "spot_texture.png" : "hmap.jpg");
+    r.set_texture(Texture(texture_path));
+
+    r.set_vertex_shader(vertex_shader);
+    r.set_cull_backfaces(true);
+    r.set_deferred(deferred);
+
+    Eigen::Vector3f eye_pos = {0,0,10};
+    std::vector<frame_record> records;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        r.set_model(get_model_matrix(angle + frame * rotate));
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, (float)width / height, 0.1, 50));
+
+        auto start = std::chrono::steady_clock::now();
+        draw();
+        double total_ms = rst::elapsed_ms(start);
+        records.push_back({r.stats(), total_ms, r.covered_pixels()});
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (!output_prefix.empty())
         {
-            std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
-            texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
+            cv::Mat image(height, width, CV_32FC3, r.frame_buffer().data());
+            image.convertTo(image, CV_8UC3, 1.0f);
+            cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d", frame);
+            cv::imwrite(output_prefix + number + ".png", image);
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+    }
+
+    // Per stage mean, min and max over all frames
+    struct summary { double mean = 0, min = 0, max = 0; };
+    auto summarize = [&](auto value) {
+        summary s;
+        s.min = s.max = value(records[0]);
+        for (const auto& rec : records)
         {
-            std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            double v = value(rec);
+            s.mean += v / records.size();
+            s.min = std::min(s.min, v);
+            s.max = std::max(s.max, v);
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        return s;
+    };
+    std::pair<const char*, summary> columns[] = {
+        {"transform_ms", summarize([](const frame_record& f) { return f.stats.transform_ms; })},
+        {"raster_ms", summarize([](const frame_record& f) { return f.stats.raster_ms; })},
+        {"shade_ms", summarize([](const frame_record& f) { return f.stats.shade_ms; })},
+        {"total_ms", summarize([](const frame_record& f) { return f.total_ms; })},
+        {"fragments", summarize([](const frame_record& f) { return (double)f.stats.fragments; })},
+        {"shaded", summarize([](const frame_record& f) { return (double)f.stats.shaded; })},
+        {"covered", summarize([](const frame_record& f) { return (double)f.covered; })},
+        {"overdraw", summarize([](const frame_record& f) { return f.overdraw(); })},
+    };
+
+    if (!csv_path.empty())
+    {
+        std::ofstream csv(csv_path);
+        csv << "frame,transform_ms,raster_ms,shade_ms,total_ms,fragments,shaded,covered,overdraw\n";
+        for (size_t i = 0; i < records.size(); ++i)
         {
-            std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            const frame_record& f = records[i];
+            csv << i << ',' << f.stats.transform_ms << ',' << f.stats.raster_ms << ',' << f.stats.shade_ms << ','
+                << f.total_ms << ',' << f.stats.fragments << ',' << f.stats.shaded << ',' << f.covered << ','
+                << f.overdraw() << "\n";
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+    }
+
+    if (!json_path.empty())
+    {
+        std::ofstream json(json_path);
+        json << "{\n  \"shader\": \"" << shader << "\", \"deferred\": " << (deferred ? "true" : "false")
+             << ", \"width\": " << width << ", \"height\": " << height << ", \"triangles\": " << indices.size() << ",\n";
+        json << "  \"frames\": [\n";
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            const frame_record& f = records[i];
+            json << "    {\"frame\": " << i << ", \"transform_ms\": " << f.stats.transform_ms
+                 << ", \"raster_ms\": " << f.stats.raster_ms << ", \"shade_ms\": " << f.stats.shade_ms
+                 << ", \"total_ms\": " << f.total_ms << ", \"fragments\": " << f.stats.fragments
+                 << ", \"shaded\": " << f.stats.shaded << ", \"covered\": " << f.covered
+                 << ", \"overdraw\": " << f.overdraw() << "}" << (i + 1 < records.size() ? "," : "") << "\n";
+        }
+        json << "  ],\n  \"summary\": {\n";
+        for (size_t i = 0; i < std::size(columns); ++i)
+        {
+            const summary& s = columns[i].second;
+            json << "    \"" << columns[i].first << "\": {\"mean\": " << s.mean << ", \"min\": " << s.min
+                 << ", \"max\": " << s.max << "}" << (i + 1 < std::size(columns) ? "," : "") << "\n";
+        }
+        json << "  }\n}\n";
+    }
+
+    std::cout << frames << " frames of " << width << "x" << height << ", " << shader
+              << (deferred ? " (deferred)" : "") << "\n";
+    for (const auto& [name, s] : columns)
+        std::cout << "  " << name << ": mean " << s.mean << ", min " << s.min << ", max " << s.max << "\n";
+    return 0;
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "--batch")
+        return run_batch(argc, argv);
+
+    std::vector<Eigen::Vector3f> positions;
+    std::vector<Eigen::Vector3f> normals;
+    std::vector<Eigen::Vector2f> texcoords;
+    std::vector<Eigen::Vector3i> indices;
+
+    float angle = 140.0;
+    bool command_line = false;
+
+    std::string filename = "output.png";
+    std::string obj_path = "../models/spot/";
+
+    // Load .obj File
+    load_mesh("../models/spot/spot_triangulated_good.obj", positions, normals, texcoords, indices);
+    std::vector<Eigen::Vector3f> colors(positions.size(), Eigen::Vector3f(148, 121, 92));
+
+    rst::rasterizer r(700, 700);
+
+    auto pos_id = r.load_positions(positions);
+    auto ind_id = r.load_indices(indices);
+    auto col_id = r.load_colors(colors);
+    r.load_normals(normals);
+    r.load_texcoords(texcoords);
+
+    auto texture_path = "hmap.jpg";
+    r.set_texture(Texture(obj_path + texture_path));
+
+    std::function<void()> draw_active_shader = shader_draw(r, "phong", pos_id, ind_id, col_id);
+
+    if (argc >= 2)
+    {
+        command_line = true;
+        filename = std::string(argv[1]);
+
+        if (argc >= 3 && shader_draw(r, argv[2], pos_id, ind_id, col_id))
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            std::cout << "Rasterizing using the " << argv[2] << " shader\n";
+            draw_active_shader = shader_draw(r, argv[2], pos_id, ind_id, col_id);
+            if (std::string(argv[2]) == "texture")
+            {
+                texture_path = "spot_texture.png";
+                r.set_texture(Texture(obj_path + texture_path));
+            }
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+
+        if (argc >= 4 && std::string(argv[3]) == "deferred")
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            std::cout << "Shading once per pixel from a G-buffer\n";
+            r.set_deferred(true);
         }
     }
 
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+    // spot is closed and wound counter clockwise
+    r.set_cull_backfaces(true);
 
     int key = 0;
     int frame_count = 0;
@@ -388,7 +637,7 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
+        draw_active_shader();
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -407,7 +656,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
         //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
+        draw_active_shader();
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
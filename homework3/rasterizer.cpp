@@ -32,6 +32,16 @@ rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f>
     return {id};
 }
 
+rst::tex_buf_id rst::rasterizer::load_texcoords(const std::vector<Eigen::Vector2f>& texcoords)
+{
+    auto id = get_next_id();
+    tex_buf.emplace(id, texcoords);
+
+    texcoord_id = id;
+
+    return {id};
+}
+
 rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
 {
     auto id = get_next_id();
@@ -149,172 +159,291 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+{
+    draw(TriangleList, function_shader{fragment_shader});
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    draw(pos_buffer, ind_buffer, col_buffer, type, function_shader{fragment_shader});
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
-
+// Perspective division and viewport transformation of a clip space position.
+// w is kept as the view space depth for perspective correct depth.
+static Eigen::Vector4f to_screen(const Eigen::Vector4f& clip, int width, int height)
+{
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
-
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
-
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
-        }
+    Eigen::Vector4f v = clip;
+    //Homogeneous division
+    v.x()/=v.w();
+    v.y()/=v.w();
+    v.z()/=v.w();
+    //Viewport transformation
+    v.x() = 0.5*width*(v.x()+1.0);
+    v.y() = 0.5*height*(v.y()+1.0);
+    v.z() = v.z() * f1 + f2;
+    return v;
+}
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+// Signed distance of p to the clip planes x = -w, x = w, y = -w, y = w,
+// z = -w and z = w, positive inside the view volume
+static float clip_distance(const Eigen::Vector4f& p, int plane)
+{
+    float d = plane & 1 ? -p[plane >> 1] : p[plane >> 1];
+    return p.w() + d;
+}
 
-        //Viewport transformation
-        for (auto & vert : v)
-        {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
-        }
+// One bit per clip plane that p lies outside of
+static int clip_outcode(const Eigen::Vector4f& p)
+{
+    int code = 0;
+    for (int plane = 0; plane < 6; ++plane)
+        if (clip_distance(p, plane) < 0)
+            code |= 1 << plane;
+    return code;
+}
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
-        }
+static rst::clip_vertex lerp(const rst::clip_vertex& a, const rst::clip_vertex& b, float t)
+{
+    rst::clip_vertex v;
+    v.clip = a.clip + t * (b.clip - a.clip);
+    v.view_pos = a.view_pos + t * (b.view_pos - a.view_pos);
+    v.normal = a.normal + t * (b.normal - a.normal);
+    v.color = a.color + t * (b.color - a.color);
+    v.tex_coords = a.tex_coords + t * (b.tex_coords - a.tex_coords);
+    return v;
+}
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
-        }
+rst::clip_vertex rst::rasterizer::make_clip_vertex(const Eigen::Vector4f& clip, const Eigen::Vector3f& view_pos,
+                                                   const Eigen::Vector3f& normal, const Eigen::Vector3f& color,
+                                                   const Eigen::Vector2f& tex_coords) const
+{
+    clip_vertex v;
+    v.clip = clip;
+    v.outcode = clip_outcode(clip);
+    if (v.outcode == 0)
+        v.screen = to_screen(clip, width, height);
+    v.view_pos = view_pos;
+    v.normal = normal;
+    v.color = color;
+    v.tex_coords = tex_coords;
+    return v;
+}
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+// Clipping stage: triangles outside one clip plane are dropped, triangles
+// crossing the view volume are clipped against the planes they cross
+// (Sutherland-Hodgman) and fanned back into triangles, and with culling on,
+// clockwise triangles on screen are dropped
+void rst::rasterizer::assemble_triangle(const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2,
+                                        assembled_triangles& out) const
+{
+    if (v0.outcode & v1.outcode & v2.outcode)
+        return;
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+    int crossed = v0.outcode | v1.outcode | v2.outcode;
+    if (crossed == 0) {
+        emit_triangle(v0, v1, v2, out);
+        return;
     }
+
+    // Every plane adds at most one vertex to the polygon
+    clip_vertex poly[9] = {v0, v1, v2}, clipped[9];
+    int n = 3;
+    for (int plane = 0; plane < 6; ++plane) {
+        if (!(crossed & (1 << plane)))
+            continue;
+        int m = 0;
+        for (int i = 0; i < n; ++i) {
+            const clip_vertex& a = poly[i];
+            const clip_vertex& b = poly[(i + 1) % n];
+            float da = clip_distance(a.clip, plane);
+            float db = clip_distance(b.clip, plane);
+            if (da >= 0)
+                clipped[m++] = a;
+            if ((da >= 0) != (db >= 0))
+                clipped[m++] = lerp(a, b, da / (da - db));
+        }
+        std::copy(clipped, clipped + m, poly);
+        n = m;
+        if (n < 3)
+            return;
+    }
+
+    for (int i = 0; i < n; ++i)
+        poly[i].screen = to_screen(poly[i].clip, width, height);
+    for (int i = 1; i + 1 < n; ++i)
+        emit_triangle(poly[0], poly[i], poly[i + 1], out);
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+void rst::rasterizer::emit_triangle(const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2,
+                                    assembled_triangles& out) const
 {
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    float area = (v1.screen.x() - v0.screen.x()) * (v2.screen.y() - v0.screen.y()) -
+                 (v2.screen.x() - v0.screen.x()) * (v1.screen.y() - v0.screen.y());
+    if (area == 0 || (cull_backfaces && area < 0))
+        return;
+
+    const clip_vertex* v[] = {&v0, &v1, &v2};
+    Triangle t;
+    std::array<Eigen::Vector3f, 3> view_pos;
+    for (int i = 0; i < 3; ++i) {
+        t.v[i] = v[i]->screen;
+        t.normal[i] = v[i]->normal;
+        t.color[i] = v[i]->color;
+        t.tex_coords[i] = v[i]->tex_coords;
+        view_pos[i] = v[i]->view_pos;
+    }
+    out.tris.push_back(t);
+    out.view_pos.push_back(view_pos);
 }
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+// Vertex and binning stages of draw()
+void rst::rasterizer::setup_triangles(std::vector<Triangle *> &TriangleList)
 {
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+    Eigen::Vector3f color = Eigen::Vector3f(148, 121, 92) / 255.f;
+
+    // Vertex stage: transform and clip every triangle in parallel
+    int num_tris = TriangleList.size();
+    int num_chunks = (num_tris + chunk_size - 1) / chunk_size;
+    assembled.resize(num_chunks);
+    parallel_for(num_chunks, num_threads, [&](int chunk) {
+        assembled_triangles& out = assembled[chunk];
+        out.tris.clear();
+        out.view_pos.clear();
+        int end = std::min(num_tris, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; ++i) {
+            const Triangle* t = TriangleList[i];
+            clip_vertex v[3];
+            for (int j = 0; j < 3; ++j) {
+                v[j] = make_clip_vertex(mvp * t->v[j], (mv * t->v[j]).head<3>(),
+                                        (inv_trans * to_vec4(t->normal[j], 0.0f)).head<3>(),
+                                        color, t->tex_coords[j]);
+            }
+            assemble_triangle(v[0], v[1], v[2], out);
+        }
+    });
 
-    u /= weight;
-    v /= weight;
+    gather_triangles();
+    bin_triangles();
+}
 
-    return Eigen::Vector2f(u, v);
+// Vertex and binning stages of the indexed draw()
+void rst::rasterizer::setup_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer)
+{
+    auto& buf = pos_buf[pos_buffer.pos_id];
+    auto& ind = ind_buf[ind_buffer.ind_id];
+    auto& col = col_buf[col_buffer.col_id];
+    const std::vector<Eigen::Vector3f>* nor = normal_id >= 0 ? &nor_buf[normal_id] : nullptr;
+    const std::vector<Eigen::Vector2f>* tex = texcoord_id >= 0 ? &tex_buf[texcoord_id] : nullptr;
+
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+
+    // Vertex stage: every shared vertex is transformed once, into the
+    // post-transform cache that the triangles below read from
+    int num_verts = buf.size();
+    vertex_cache.resize(num_verts);
+    parallel_for((num_verts + chunk_size - 1) / chunk_size, num_threads, [&](int chunk) {
+        int end = std::min(num_verts, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; ++i) {
+            Eigen::Vector4f p = to_vec4(buf[i], 1.0f);
+            //view space normal
+            Eigen::Vector3f n = Eigen::Vector3f::Zero();
+            if (nor)
+                n = (inv_trans * to_vec4((*nor)[i], 0.0f)).head<3>();
+            Eigen::Vector2f uv = tex ? (*tex)[i] : Eigen::Vector2f(0, 0);
+            vertex_cache[i] = make_clip_vertex(mvp * p, (mv * p).head<3>(), n, col[i] / 255.f, uv);
+        }
+    });
+
+    // Primitive assembly and clipping from the vertex cache
+    int num_tris = ind.size();
+    int num_chunks = (num_tris + chunk_size - 1) / chunk_size;
+    assembled.resize(num_chunks);
+    parallel_for(num_chunks, num_threads, [&](int chunk) {
+        assembled_triangles& out = assembled[chunk];
+        out.tris.clear();
+        out.view_pos.clear();
+        int end = std::min(num_tris, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; ++i)
+            assemble_triangle(vertex_cache[ind[i][0]], vertex_cache[ind[i][1]], vertex_cache[ind[i][2]], out);
+    });
+
+    gather_triangles();
+    bin_triangles();
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+// Concatenates the per chunk output of the clipping stage into screen_tris,
+// keeping the submission order
+void rst::rasterizer::gather_triangles()
 {
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
-
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
-
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
-
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
-    float minX = width - 1;
-    float maxX = 0;
-    float minY = height - 1;
-    float maxY = 0;
-    for (auto vp : t.v) {
-        minX = std::min(minX, vp.x());
-        maxX = std::max(maxX, vp.x());
-        minY = std::min(minY, vp.y());
-        maxY = std::max(maxY, vp.y());
-    }
-    minX = std::max(0.f, minX);
-    maxX = std::min(width - 1.f, maxX);
-    minY = std::max(0.f, minY);
-    maxY = std::min(height - 1.f, maxY);
-    for (int x = minX; x <= maxX; x++) {
-        for (int y = minY; y <= maxY; y++) {
-            if (insideTriangle(x + 0.5, y + 0.5, t.v)) {
-                auto [alpha, beta, gamma] = computeBarycentric2D(x + 0.5, y + 0.5, t.v);
-                float Z = 1.0 / (alpha / t.v[0].w() + beta / t.v[1].w() + gamma / t.v[2].w());
-                float zp = alpha * t.v[0].z() / t.v[0].w() + beta * t.v[1].z() / t.v[1].w() + gamma * t.v[2].z() / t.v[2].w();
-                zp *= Z;
-                if (zp < depth_buf[get_index(x, y)]) {
-                    depth_buf[get_index(x, y)] = zp;
-                    auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1);
-                    auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1);
-                    auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
-                    auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1);
-                    fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-                    payload.view_pos = interpolated_shadingcoords;
-
-                    auto pixel_color = fragment_shader(payload);
-                    set_pixel(Vector2i(x, y), pixel_color);
-                }
-            }
+    std::vector<int> offsets(assembled.size() + 1, 0);
+    for (size_t chunk = 0; chunk < assembled.size(); ++chunk)
+        offsets[chunk + 1] = offsets[chunk] + assembled[chunk].tris.size();
+    screen_tris.resize(offsets.back());
+    screen_view_pos.resize(offsets.back());
+    parallel_for(assembled.size(), num_threads, [&](int chunk) {
+        std::copy(assembled[chunk].tris.begin(), assembled[chunk].tris.end(), screen_tris.begin() + offsets[chunk]);
+        std::copy(assembled[chunk].view_pos.begin(), assembled[chunk].view_pos.end(), screen_view_pos.begin() + offsets[chunk]);
+    });
+}
+
+// Binning: every chunk sorts its triangles into the tiles their bounding
+// box touches. Chunks own their bins, so no locking is needed, and
+// reading them back chunk by chunk keeps the submission order.
+void rst::rasterizer::bin_triangles()
+{
+    int num_tris = screen_tris.size();
+    int num_chunks = (num_tris + chunk_size - 1) / chunk_size;
+    int num_tiles = tiles_x * tiles_y;
+    tile_bins.resize(num_chunks);
+    parallel_for(num_chunks, num_threads, [&](int chunk) {
+        auto& bins = tile_bins[chunk];
+        bins.resize(num_tiles);
+        for (auto& bin : bins)
+            bin.clear();
+        int end = std::min(num_tris, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; ++i) {
+            const Triangle& t = screen_tris[i];
+            float minX = std::min({t.v[0].x(), t.v[1].x(), t.v[2].x()});
+            float maxX = std::max({t.v[0].x(), t.v[1].x(), t.v[2].x()});
+            float minY = std::min({t.v[0].y(), t.v[1].y(), t.v[2].y()});
+            float maxY = std::max({t.v[0].y(), t.v[1].y(), t.v[2].y()});
+            if (maxX < 0 || maxY < 0 || minX > width - 1 || minY > height - 1)
+                continue;
+            int tx0 = std::max(0, (int)minX / tile_size);
+            int tx1 = std::min(tiles_x - 1, (int)maxX / tile_size);
+            int ty0 = std::max(0, (int)minY / tile_size);
+            int ty1 = std::min(tiles_y - 1, (int)maxY / tile_size);
+            for (int ty = ty0; ty <= ty1; ++ty)
+                for (int tx = tx0; tx <= tx1; ++tx)
+                    bins[ty * tiles_x + tx].push_back(i);
         }
-    }
+    });
+}
+
+void rst::rasterizer::update_block_zmax(int bx, int by)
+{
+    float zmax = -std::numeric_limits<float>::infinity();
+    int x_end = std::min((bx + 1) * block_size, width);
+    int y_end = std::min((by + 1) * block_size, height);
+    for (int y = by * block_size; y < y_end; ++y)
+        for (int x = bx * block_size; x < x_end; ++x)
+            zmax = std::max(zmax, depth_buf[get_index(x, y)]);
+    block_zmax[by * blocks_x + bx] = zmax;
+}
+
+long long rst::rasterizer::covered_pixels() const
+{
+    return std::count_if(depth_buf.begin(), depth_buf.end(),
+                         [](float z) { return z != std::numeric_limits<float>::infinity(); });
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -341,6 +470,8 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(block_zmax.begin(), block_zmax.end(), std::numeric_limits<float>::infinity());
+        std::fill(tile_zmax.begin(), tile_zmax.end(), std::numeric_limits<float>::infinity());
     }
 }
 
@@ -348,19 +479,24 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
+    gbuffer.resize(w * h);
 
-    texture = std::nullopt;
-}
+    tiles_x = (w + tile_size - 1) / tile_size;
+    tiles_y = (h + tile_size - 1) / tile_size;
+    blocks_x = (w + block_size - 1) / block_size;
+    blocks_y = (h + block_size - 1) / block_size;
+    block_zmax.resize(blocks_x * blocks_y, std::numeric_limits<float>::infinity());
+    tile_zmax.resize(tiles_x * tiles_y, std::numeric_limits<float>::infinity());
 
-int rst::rasterizer::get_index(int x, int y)
-{
-    return (height-y)*width + x;
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    texture = std::nullopt;
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
+    int ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
 }
 
@@ -7,6 +7,15 @@
 #include <eigen3/Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
@@ -57,6 +66,65 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    // Interpolated fragment attributes kept per pixel in deferred mode
+    struct gbuffer_texel
+    {
+        Eigen::Vector3f color;
+        Eigen::Vector3f normal;
+        Eigen::Vector3f view_pos;
+        Eigen::Vector2f tex_coords;
+        Eigen::Vector2f tex_coords_dx;
+        Eigen::Vector2f tex_coords_dy;
+        bool written = false;
+    };
+
+    // Timings and counters of the last draw()
+    struct frame_stats
+    {
+        double transform_ms = 0;    // vertex, clipping and binning stages
+        double raster_ms = 0;       // raster stage, shading included unless deferred
+        double shade_ms = 0;        // deferred shading pass
+        long long fragments = 0;    // fragments that passed the depth test
+        long long shaded = 0;       // fragment shader invocations
+    };
+
+    // Adapts a shader set with set_fragment_shader to the templated draw
+    struct function_shader
+    {
+        static constexpr unsigned attributes = attr_all;
+        const std::function<Eigen::Vector3f(fragment_shader_payload)>& func;
+
+        Eigen::Vector3f operator()(const fragment_shader_payload& payload) const
+        {
+            return func(payload);
+        }
+    };
+
+    // A vertex between the vertex and raster stages. screen is only set
+    // once the vertex is known to be inside the view volume.
+    struct clip_vertex
+    {
+        Eigen::Vector4f clip;
+        Eigen::Vector4f screen;
+        Eigen::Vector3f view_pos;
+        Eigen::Vector3f normal;
+        Eigen::Vector3f color;
+        Eigen::Vector2f tex_coords;
+        int outcode = 0;
+    };
+
+    // Triangles one chunk of the clipping stage passes on to the raster stage
+    struct assembled_triangles
+    {
+        std::vector<Triangle> tris;
+        std::vector<std::array<Eigen::Vector3f, 3>> view_pos;
+    };
+
     class rasterizer
     {
     public:
@@ -65,6 +133,7 @@ namespace rst
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        tex_buf_id load_texcoords(const std::vector<Eigen::Vector2f>& texcoords);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -77,19 +146,62 @@ namespace rst
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // In deferred mode draw() rasterizes attributes into a G-buffer and
+        // then runs the fragment shader once for every pixel it covered
+        void set_deferred(bool enable) { deferred = enable; }
+
+        // Drops triangles that are clockwise on screen, i.e. facing away
+        // from the camera for counter clockwise meshes
+        void set_cull_backfaces(bool enable) { cull_backfaces = enable; }
+
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
 
+        // Draws with a shader type known at compile time (see static_shader),
+        // so it is inlined into the raster loop and only the attributes it
+        // declares are interpolated
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader);
+
+        // Indexed mesh: positions and colors (0-255) per vertex, with the
+        // last loaded normals and texture coordinates, also per vertex
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const Shader& shader);
+
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+        const frame_stats& stats() const { return last_stats; }
+
+        // Pixels whose depth was written since the depth buffer was cleared
+        long long covered_pixels() const;
+
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void setup_triangles(std::vector<Triangle *> &TriangleList);
+        void setup_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer);
+        void gather_triangles();
+        void bin_triangles();
+
+        clip_vertex make_clip_vertex(const Eigen::Vector4f& clip, const Eigen::Vector3f& view_pos,
+                                     const Eigen::Vector3f& normal, const Eigen::Vector3f& color,
+                                     const Eigen::Vector2f& tex_coords) const;
+        void assemble_triangle(const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2,
+                               assembled_triangles& out) const;
+        void emit_triangle(const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2,
+                           assembled_triangles& out) const;
+
+        template <typename Shader>
+        void draw_tiles(const Shader& shader);
+
+        // Returns the number of fragments that passed the depth test
+        template <typename Shader>
+        int rasterize_triangle(const Shader& shader, const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                               int x0, int y0, int x1, int y1);
 
-        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
+        // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> Culling -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
         Eigen::Matrix4f model;
@@ -97,11 +209,13 @@ namespace rst
         Eigen::Matrix4f projection;
 
         int normal_id = -1;
+        int texcoord_id = -1;
 
         std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
         std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        std::map<int, std::vector<Eigen::Vector2f>> tex_buf;
 
         std::optional<Texture> texture;
 
@@ -110,11 +224,433 @@ namespace rst
 
         std::vector<Eigen::Vector3f> frame_buf;
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        std::vector<gbuffer_texel> gbuffer;
+        bool deferred = false;
+        int get_index(int x, int y) const { return (height-1-y)*width + x; }
 
         int width, height;
 
+        // Tiled back end: triangles are transformed in chunks of chunk_size,
+        // binned into tile_size x tile_size screen tiles, and the tiles are
+        // rasterized in parallel on num_threads threads
+        int num_threads = 1;
+        static constexpr int tile_size = 64;
+        static constexpr int chunk_size = 256;
+        std::vector<Triangle> screen_tris;
+        std::vector<std::array<Eigen::Vector3f, 3>> screen_view_pos;
+        std::vector<clip_vertex> vertex_cache;
+        std::vector<assembled_triangles> assembled;
+        bool cull_backfaces = false;
+        std::vector<std::vector<std::vector<int>>> tile_bins;
+        int tiles_x, tiles_y;
+
+        // Hierarchical z: the farthest depth_buf value of every block_size x
+        // block_size block and of every tile. Triangles and blocks whose
+        // nearest depth is behind it are rejected before per-pixel work.
+        static constexpr int block_size = 8;
+        int blocks_x, blocks_y;
+        std::vector<float> block_zmax;
+        std::vector<float> tile_zmax;
+        void update_block_zmax(int bx, int by);
+
+        frame_stats last_stats;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
+
+    // Edge function E(p) = A * p.x + B * p.y + C of the directed edge a -> b,
+    // set up once per triangle. It is evaluated exactly at the top left pixel
+    // of each block and stepped from there by A per column and B per row.
+    // Blocks lie on a fixed grid, so the edge a triangle shares with its
+    // neighbour gets exactly negated values at every pixel and is drawn once.
+    // Whole blocks are accepted or rejected by their corners, allowing for
+    // the rounding of the steps.
+    struct Edge
+    {
+        float A, B, C;
+        bool top_left;
+
+        Edge(const Eigen::Vector4f& a, const Eigen::Vector4f& b, float sign)
+        {
+            A = sign * (a.y() - b.y());
+            B = sign * (b.x() - a.x());
+            C = sign * (a.x() * b.y() - a.y() * b.x());
+            // Pixels exactly on an edge belong to the triangle only on its
+            // left edges and horizontal top edge, so shared edges are drawn once
+            top_left = A > 0 || (A == 0 && B < 0);
+        }
+
+        float row(float y) const { return B * y + C; }
+        bool inside(float e) const { return e > 0 || (e == 0 && top_left); }
+    };
+
+    // Calls func(i) for every i in [0, n) on all worker threads, each thread
+    // taking the next index from a shared counter
+    template <typename F>
+    void parallel_for(int n, int num_threads, F&& func)
+    {
+        std::atomic<int> next(0);
+        auto worker = [&]() {
+            for (int i = next++; i < n; i = next++)
+                func(i);
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < std::min(num_threads, n); ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& th : threads)
+            th.join();
+    }
+
+    inline double elapsed_ms(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    inline Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+    {
+        return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    }
+
+    inline Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+    {
+        auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
+        auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+
+        u /= weight;
+        v /= weight;
+
+        return Eigen::Vector2f(u, v);
+    }
+}
+
+template <typename Shader>
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList, const Shader& shader)
+{
+    last_stats = frame_stats();
+    auto start = std::chrono::steady_clock::now();
+    setup_triangles(TriangleList);
+    last_stats.transform_ms = elapsed_ms(start);
+    draw_tiles(shader);
+}
+
+template <typename Shader>
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const Shader& shader)
+{
+    if (type != rst::Primitive::Triangle)
+    {
+        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    }
+    last_stats = frame_stats();
+    auto start = std::chrono::steady_clock::now();
+    setup_indexed(pos_buffer, ind_buffer, col_buffer);
+    last_stats.transform_ms = elapsed_ms(start);
+    draw_tiles(shader);
+}
+
+// Raster and deferred shading stages shared by both draw() paths
+template <typename Shader>
+void rst::rasterizer::draw_tiles(const Shader& shader)
+{
+    int num_tiles = tiles_x * tiles_y;
+    int num_chunks = tile_bins.size();
+    std::atomic<long long> fragments(0), shaded(0);
+
+    // Raster stage: tiles cover disjoint pixels, so they are shaded
+    // concurrently without locks on the frame and depth buffers
+    auto start = std::chrono::steady_clock::now();
+    parallel_for(num_tiles, num_threads, [&](int tile) {
+        int x0 = (tile % tiles_x) * tile_size;
+        int y0 = (tile / tiles_x) * tile_size;
+        int x1 = std::min(x0 + tile_size, width) - 1;
+        int y1 = std::min(y0 + tile_size, height) - 1;
+        long long tile_fragments = 0;
+        for (int chunk = 0; chunk < num_chunks; ++chunk) {
+            for (int i : tile_bins[chunk][tile]) {
+                // Also pass view space vertice position
+                tile_fragments += rasterize_triangle(shader, screen_tris[i], screen_view_pos[i], x0, y0, x1, y1);
+            }
+        }
+        fragments += tile_fragments;
+    });
+    last_stats.raster_ms = elapsed_ms(start);
+    last_stats.fragments = fragments;
+    if (!deferred)
+        last_stats.shaded = fragments;
+
+    // Deferred shading: only the surviving fragment of every pixel reaches
+    // the fragment shader. Pixels this draw did not cover keep their color.
+    if (deferred) {
+        start = std::chrono::steady_clock::now();
+        parallel_for(height, num_threads, [&](int row) {
+            long long row_shaded = 0;
+            for (int x = 0; x < width; ++x) {
+                gbuffer_texel& texel = gbuffer[row * width + x];
+                if (!texel.written)
+                    continue;
+                texel.written = false;
+                // Only the attributes of the shader were stored
+                fragment_shader_payload payload;
+                if constexpr ((Shader::attributes & attr_color) != 0)
+                    payload.color = texel.color;
+                if constexpr ((Shader::attributes & attr_normal) != 0)
+                    payload.normal = texel.normal;
+                if constexpr ((Shader::attributes & attr_tex_coords) != 0) {
+                    payload.tex_coords = texel.tex_coords;
+                    payload.tex_coords_dx = texel.tex_coords_dx;
+                    payload.tex_coords_dy = texel.tex_coords_dy;
+                }
+                if constexpr ((Shader::attributes & attr_view_pos) != 0)
+                    payload.view_pos = texel.view_pos;
+                payload.texture = texture ? &*texture : nullptr;
+                frame_buf[row * width + x] = shader(payload);
+                ++row_shaded;
+            }
+            shaded += row_shaded;
+        });
+        last_stats.shade_ms = elapsed_ms(start);
+        last_stats.shaded = shaded;
+    }
+}
+
+//Screen space rasterization of the part of t inside the tile [x0, x1] x [y0, y1]
+template <typename Shader>
+int rst::rasterizer::rasterize_triangle(const Shader& shader, const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                        int x0, int y0, int x1, int y1)
+{
+    // TODO: From your HW3, get the triangle rasterization code.
+    // TODO: Inside your rasterization loop:
+    //    * v[i].w() is the vertex view space depth value z.
+    //    * Z is interpolated view space depth for the current pixel
+    //    * zp is depth between zNear and zFar, used for z-buffer
+
+    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+    // zp *= Z;
+
+    // TODO: Interpolate the attributes:
+    // auto interpolated_color
+    // auto interpolated_normal
+    // auto interpolated_texcoords
+    // auto interpolated_shadingcoords
+
+    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+    // Use: payload.view_pos = interpolated_shadingcoords;
+    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
+    // Use: auto pixel_color = fragment_shader(payload);
+    float minX = width - 1;
+    float maxX = 0;
+    float minY = height - 1;
+    float maxY = 0;
+    for (auto vp : t.v) {
+        minX = std::min(minX, vp.x());
+        maxX = std::max(maxX, vp.x());
+        minY = std::min(minY, vp.y());
+        maxY = std::max(maxY, vp.y());
+    }
+    int xmin = std::max(x0, (int)std::floor(minX));
+    int xmax = std::min(x1, (int)std::ceil(maxX));
+    int ymin = std::max(y0, (int)std::floor(minY));
+    int ymax = std::min(y1, (int)std::ceil(maxY));
+    if (xmin > xmax || ymin > ymax)
+        return 0;
+
+    // Edge i is opposite to vertex i, so E_i / area is its barycentric weight.
+    // Both windings are drawn; clockwise triangles get their edges flipped.
+    float area = (t.v[1].x() - t.v[0].x()) * (t.v[2].y() - t.v[0].y()) -
+                 (t.v[2].x() - t.v[0].x()) * (t.v[1].y() - t.v[0].y());
+    if (area == 0)
+        return 0;
+    float sign = area > 0 ? 1.f : -1.f;
+    const Edge edges[3] = {Edge(t.v[1], t.v[2], sign), Edge(t.v[2], t.v[0], sign), Edge(t.v[0], t.v[1], sign)};
+    float inv_area = 1.f / (sign * area);
+
+    // Texture coordinates are interpolated affinely in screen space, so
+    // their screen derivatives are constant over the triangle
+    Eigen::Vector2f duv_dx, duv_dy;
+    if constexpr ((Shader::attributes & attr_tex_coords) != 0) {
+        duv_dx = (edges[0].A * t.tex_coords[0] + edges[1].A * t.tex_coords[1] + edges[2].A * t.tex_coords[2]) * inv_area;
+        duv_dy = (edges[0].B * t.tex_coords[0] + edges[1].B * t.tex_coords[1] + edges[2].B * t.tex_coords[2]) * inv_area;
+    }
+
+    // zp blends the vertex depths with the weights alpha / w, beta / w and
+    // gamma / w. When all w share a sign these are convex, so no pixel of t
+    // is nearer than its nearest vertex; the margin covers rounding in zp.
+    float tri_zmin = -std::numeric_limits<float>::infinity();
+    if ((t.v[0].w() > 0 && t.v[1].w() > 0 && t.v[2].w() > 0) ||
+        (t.v[0].w() < 0 && t.v[1].w() < 0 && t.v[2].w() < 0)) {
+        tri_zmin = std::min({t.v[0].z(), t.v[1].z(), t.v[2].z()});
+        tri_zmin -= 1e-5f * (1 + std::abs(tri_zmin));
+    }
+    float& tile_max = tile_zmax[(y0 / tile_size) * tiles_x + x0 / tile_size];
+    if (tri_zmin >= tile_max)
+        return 0;
+
+    bool block_written = false, tile_written = false;
+    int fragments = 0;
+    auto shade_pixel = [&](int x, int y, float e0, float e1, float e2) {
+        float alpha = e0 * inv_area, beta = e1 * inv_area, gamma = e2 * inv_area;
+        float Z = 1.0 / (alpha / t.v[0].w() + beta / t.v[1].w() + gamma / t.v[2].w());
+        float zp = alpha * t.v[0].z() / t.v[0].w() + beta * t.v[1].z() / t.v[1].w() + gamma * t.v[2].z() / t.v[2].w();
+        zp *= Z;
+        if (zp < depth_buf[get_index(x, y)]) {
+            depth_buf[get_index(x, y)] = zp;
+            block_written = true;
+            ++fragments;
+            fragment_shader_payload payload;
+            if constexpr ((Shader::attributes & attr_color) != 0)
+                payload.color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1);
+            if constexpr ((Shader::attributes & attr_normal) != 0)
+                payload.normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1).normalized();
+            if constexpr ((Shader::attributes & attr_tex_coords) != 0) {
+                payload.tex_coords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
+                payload.tex_coords_dx = duv_dx;
+                payload.tex_coords_dy = duv_dy;
+            }
+            if constexpr ((Shader::attributes & attr_view_pos) != 0)
+                payload.view_pos = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1);
+            if (deferred) {
+                // Attributes the shader does not read were never interpolated
+                gbuffer_texel& texel = gbuffer[get_index(x, y)];
+                if constexpr ((Shader::attributes & attr_color) != 0)
+                    texel.color = payload.color;
+                if constexpr ((Shader::attributes & attr_normal) != 0)
+                    texel.normal = payload.normal;
+                if constexpr ((Shader::attributes & attr_tex_coords) != 0) {
+                    texel.tex_coords = payload.tex_coords;
+                    texel.tex_coords_dx = payload.tex_coords_dx;
+                    texel.tex_coords_dy = payload.tex_coords_dy;
+                }
+                if constexpr ((Shader::attributes & attr_view_pos) != 0)
+                    texel.view_pos = payload.view_pos;
+                texel.written = true;
+                return;
+            }
+            payload.texture = texture ? &*texture : nullptr;
+            frame_buf[get_index(x, y)] = shader(payload);
+        }
+    };
+
+    // Steps of the edge functions from the first column of a block to the
+    // others, the same for every block
+    alignas(16) float col_step[3][block_size];
+    // Bound on how far stepped values drift from the exact edge function,
+    // a few roundings of the largest terms over the bounding box
+    float step_error[3];
+    for (int i = 0; i < 3; ++i) {
+        for (int k = 0; k < block_size; ++k)
+            col_step[i][k] = k * edges[i].A;
+        step_error[i] = 4 * block_size * std::numeric_limits<float>::epsilon() *
+                        (std::abs(edges[i].A) * (xmax + 1) + std::abs(edges[i].B) * (ymax + 1) + std::abs(edges[i].C));
+    }
+
+    // Walk the bounding box in 8x8 blocks aligned to the block grid, sampling
+    // at pixel centers. A block is skipped when one edge is negative at all of
+    // it, and its pixels skip the edge tests when all edges are positive.
+    for (int by = ymin - ymin % block_size; by <= ymax; by += block_size) {
+        int row_begin = std::max(by, ymin), row_end = std::min(by + block_size - 1, ymax);
+        for (int bx = xmin - xmin % block_size; bx <= xmax; bx += block_size) {
+            if (tri_zmin >= block_zmax[(by / block_size) * blocks_x + bx / block_size])
+                continue;
+            int col_begin = std::max(bx, xmin), col_end = std::min(bx + block_size - 1, xmax);
+            float cx[2] = {col_begin + 0.5f, col_end + 0.5f};
+            float cy[2] = {row_begin + 0.5f, row_end + 0.5f};
+            bool reject = false, accept = true;
+            // Edge values of the block's current row, starting at its top row
+            alignas(16) float ex[3][block_size];
+            for (int i = 0; i < 3; ++i) {
+                const Edge& e = edges[i];
+                // The corners are evaluated directly, so they only decide
+                // for the whole block when they are further from zero than
+                // the stepped values can drift
+                float e_max = e.A * cx[e.A > 0] + e.row(cy[e.B > 0]);
+                float e_min = e.A * cx[e.A <= 0] + e.row(cy[e.B <= 0]);
+                reject |= e_max < -step_error[i];
+                accept &= e_min > step_error[i];
+                float origin = e.A * (bx + 0.5f) + e.row(by + 0.5f);
+                for (int k = 0; k < block_size; ++k)
+                    ex[i][k] = origin + col_step[i][k];
+            }
+            if (reject)
+                continue;
+
+            // Lanes of the block columns inside [col_begin, col_end]
+            int lanes = 0;
+            for (int k = 0; k < block_size; ++k)
+                if (bx + k >= col_begin && bx + k <= col_end)
+                    lanes |= 1 << k;
+
+#if defined(__SSE2__)
+            __m128 row0[block_size / 4], row1[block_size / 4], row2[block_size / 4];
+            for (int h = 0; h < block_size / 4; ++h) {
+                row0[h] = _mm_load_ps(&ex[0][4 * h]);
+                row1[h] = _mm_load_ps(&ex[1][4 * h]);
+                row2[h] = _mm_load_ps(&ex[2][4 * h]);
+            }
+            const __m128 step0 = _mm_set1_ps(edges[0].B), step1 = _mm_set1_ps(edges[1].B), step2 = _mm_set1_ps(edges[2].B);
+#endif
+            for (int y = by; y <= row_end; ++y) {
+                alignas(16) float e0[block_size], e1[block_size], e2[block_size];
+                int mask = lanes;
+#if defined(__SSE2__)
+                int covered = 0;
+                for (int k = 0; k < block_size; k += 4) {
+                    __m128 v0 = row0[k / 4], v1 = row1[k / 4], v2 = row2[k / 4];
+                    row0[k / 4] = _mm_add_ps(v0, step0);
+                    row1[k / 4] = _mm_add_ps(v1, step1);
+                    row2[k / 4] = _mm_add_ps(v2, step2);
+                    if (y < row_begin)
+                        continue;
+                    _mm_store_ps(&e0[k], v0);
+                    _mm_store_ps(&e1[k], v1);
+                    _mm_store_ps(&e2[k], v2);
+                    if (!accept) {
+                        __m128 zero = _mm_setzero_ps();
+                        __m128 m0 = edges[0].top_left ? _mm_cmpge_ps(v0, zero) : _mm_cmpgt_ps(v0, zero);
+                        __m128 m1 = edges[1].top_left ? _mm_cmpge_ps(v1, zero) : _mm_cmpgt_ps(v1, zero);
+                        __m128 m2 = edges[2].top_left ? _mm_cmpge_ps(v2, zero) : _mm_cmpgt_ps(v2, zero);
+                        covered |= _mm_movemask_ps(_mm_and_ps(m0, _mm_and_ps(m1, m2))) << k;
+                    }
+                }
+#else
+                int covered = 0;
+                for (int k = 0; k < block_size; ++k) {
+                    e0[k] = ex[0][k];
+                    e1[k] = ex[1][k];
+                    e2[k] = ex[2][k];
+                    ex[0][k] += edges[0].B;
+                    ex[1][k] += edges[1].B;
+                    ex[2][k] += edges[2].B;
+                    if (y < row_begin)
+                        continue;
+                    if (!accept && edges[0].inside(e0[k]) && edges[1].inside(e1[k]) && edges[2].inside(e2[k]))
+                        covered |= 1 << k;
+                }
+#endif
+                if (y < row_begin)
+                    continue;
+                if (!accept)
+                    mask &= covered;
+                for (int k = 0; mask; ++k, mask >>= 1) {
+                    if (mask & 1)
+                        shade_pixel(bx + k, y, e0[k], e1[k], e2[k]);
+                }
+            }
+            if (block_written) {
+                update_block_zmax(bx / block_size, by / block_size);
+                block_written = false;
+                tile_written = true;
+            }
+        }
+    }
+
+    // Blocks never straddle tiles, since tile_size is a multiple of block_size
+    if (tile_written) {
+        tile_max = -std::numeric_limits<float>::infinity();
+        for (int by = y0 / block_size; by <= y1 / block_size; ++by)
+            for (int bx = x0 / block_size; bx <= x1 / block_size; ++bx)
+                tile_max = std::max(tile_max, block_zmax[by * blocks_x + bx]);
+    }
+    return fragments;
 }
@@ -105,6 +105,26 @@ std::optional<hit_payload> trace(
     return payload;
 }
 
+// [comment]
+// Shadow ray version of trace(). Returns true as soon as any object is hit
+// closer than tMax, without looking for the closest one or filling a payload.
+// [/comment]
+bool occluded(
+        const Vector3f &orig, const Vector3f &dir,
+        const std::vector<std::unique_ptr<Object> > &objects, float tMax)
+{
+    for (const auto & object : objects)
+    {
+        float tNearK = kInfinity;
+        uint32_t indexK;
+        Vector2f uvK;
+        if (object->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tMax)
+            return true;
+    }
+
+    return false;
+}
+
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
@@ -184,8 +204,7 @@ Vector3f castRay(
                     lightDir = normalize(lightDir);
                     float LdotN = std::max(0.f, dotProduct(lightDir, N));
                     // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                    auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
-                    bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
+                    bool inShadow = occluded(shadowPointOrig, lightDir, scene.get_objects(), std::sqrt(lightDistance2));
 
                     lightAmt += inShadow ? 0 : light->intensity * LdotN;
                     Vector3f reflectionDirection = reflect(-lightDir, N);
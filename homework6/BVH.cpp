@@ -166,4 +166,25 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     if (isectLeft.happened) isect = isectLeft;
     if (isectRight.happened && isectRight.distance < isect.distance) isect = isectRight;
     return isect;
-}
\ No newline at end of file
+}
+
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const
+{
+    if (!root)
+        return false;
+    return BVHAccel::getIntersectionP(root, ray, tMax);
+}
+
+bool BVHAccel::getIntersectionP(BVHBuildNode* node, const Ray& ray, float tMax) const
+{
+    Vector3f dir = ray.direction;
+    std::array<int, 3> dirIsNeg = { int(dir.x > 0), int(dir.y > 0), int(dir.z > 0) };
+    if (!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tMax)) {
+        return false;
+    }
+    if (node->object != nullptr) {
+        return node->object->intersectP(ray, tMax);
+    }
+    // Any blocker will do, so the right child is skipped once the left one has one
+    return getIntersectionP(node->left, ray, tMax) || getIntersectionP(node->right, ray, tMax);
+}
@@ -34,7 +34,9 @@ public:
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
+    // Whether anything is hit closer than tMax, stops at the first blocker
+    bool IntersectP(const Ray &ray, float tMax) const;
+    bool getIntersectionP(BVHBuildNode* node, const Ray& ray, float tMax) const;
     BVHBuildNode* root;
 
     // BVHAccel Private Methods
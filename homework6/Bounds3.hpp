@@ -84,14 +84,16 @@ class Bounds3
         return (i == 0) ? pMin : pMax;
     }
 
+    // tMax: only boxes entered before tMax count as hit
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
-                           const std::array<int, 3>& dirisNeg) const;
+                           const std::array<int, 3>& dirisNeg,
+                           float tMax = std::numeric_limits<float>::infinity()) const;
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+                                const std::array<int, 3>& dirIsNeg, float tMax) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
@@ -128,7 +130,7 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
         tExit = std::min(tExit, (minZ - ray.origin.z) * invDir.z);
     }
 
-    return tEnter < tExit && tExit > 0;
+    return tEnter < tExit && tExit > 0 && tEnter < tMax;
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
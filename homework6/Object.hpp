@@ -19,6 +19,12 @@ public:
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // Whether the ray hits the object closer than tMax, for shadow rays
+    virtual bool intersectP(const Ray& ray, float tMax)
+    {
+        Intersection hit = getIntersection(ray);
+        return hit.happened && hit.distance < tMax;
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
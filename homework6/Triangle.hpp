@@ -186,6 +186,11 @@ public:
         return intersec;
     }
 
+    bool intersectP(const Ray& ray, float tMax) override
+    {
+        return bvh && bvh->IntersectP(ray, tMax);
+    }
+
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
     uint32_t numTriangles;
@@ -0,0 +1,83 @@
+#ifndef RAYTRACING_ALIASTABLE_H
+#define RAYTRACING_ALIASTABLE_H
+
+#include <vector>
+#include <algorithm>
+
+// Walker's alias method: draws index i with probability weights[i] / sum
+// in constant time after a linear time build (Vose's construction).
+class AliasTable
+{
+public:
+    AliasTable() {}
+
+    explicit AliasTable(const std::vector<float>& weights)
+    {
+        int n = weights.size();
+        bins.resize(n);
+        double sum = 0;
+        for (float w : weights)
+            sum += w;
+        if (n == 0 || sum <= 0)
+            return;
+
+        // Scale so the average bin holds probability 1
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; ++i) {
+            bins[i].pmf = weights[i] / sum;
+            scaled[i] = bins[i].pmf * n;
+            if (scaled[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+        // Fill each small bin up with the excess of a large one
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s].prob = scaled[s];
+            bins[s].alias = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Leftovers are 1 up to rounding
+        for (int i : small) {
+            bins[i].prob = 1;
+            bins[i].alias = i;
+        }
+        for (int i : large) {
+            bins[i].prob = 1;
+            bins[i].alias = i;
+        }
+    }
+
+    // u1 and u2 are independent uniform floats in [0, 1). u1 picks the bin
+    // and u2 decides between it and its alias; taking both from one float
+    // would leave too few bits for the second choice when there are many
+    // bins. Returns -1 when the table is empty.
+    int sample(float u1, float u2) const
+    {
+        int n = bins.size();
+        if (n == 0)
+            return -1;
+        int i = std::min(int(u1 * n), n - 1);
+        return (u2 < bins[i].prob) ? i : bins[i].alias;
+    }
+
+    float pmf(int i) const { return bins[i].pmf; }
+    int size() const { return bins.size(); }
+
+private:
+    struct Bin
+    {
+        float prob = 0, pmf = 0;
+        int alias = 0;
+    };
+    std::vector<Bin> bins;
+};
+
+#endif //RAYTRACING_ALIASTABLE_H
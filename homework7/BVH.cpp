@@ -12,7 +12,24 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    BVHBuildNode* root = recursiveBuild(primitives);
+    // Leaves index into primitives, so keep them in tree order
+    primitives.swap(orderedPrimitives);
+    orderedPrimitives.clear();
+    Vector3f v0, e1, e2;
+    triangleLeaves = std::all_of(primitives.begin(), primitives.end(), [&](Object* obj) {
+        return obj->getTriangle(v0, e1, e2);
+    });
+    collapseBVHTree(root);
+    deleteBuildTree(root);
+
+    std::vector<float> areas;
+    totalArea = 0;
+    for (Object* obj : primitives) {
+        areas.push_back(obj->getArea());
+        totalArea += obj->getArea();
+    }
+    primitiveDistribution = AliasTable(areas);
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -28,115 +45,575 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
 BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 {
     BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
 
     // Compute bounds of all primitives in BVH node
     Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
+    for (size_t i = 0; i < objects.size(); ++i)
         bounds = Union(bounds, objects[i]->getBounds());
     if (objects.size() == 1) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
-    }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
-
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
-    }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
+        return createLeaf(node, bounds, objects);
+    }
+
+    Bounds3 centroidBounds;
+    for (size_t i = 0; i < objects.size(); ++i)
+        centroidBounds =
+            Union(centroidBounds, objects[i]->getBounds().Centroid());
+    int dim = centroidBounds.maxExtent();
+    const Vector3f& cMin = centroidBounds.pMin;
+    const Vector3f& cMax = centroidBounds.pMax;
+    if (cMax[dim] == cMin[dim]) {
+        // All centroids coincide, no split can separate them
+        return createLeaf(node, bounds, objects);
+    }
+
+    auto centroidOf = [dim](Object* obj) {
+        const Vector3f c = obj->getBounds().Centroid();
+        return c[dim];
+    };
+
+    auto middling = objects.begin() + (objects.size() / 2);
+    switch (splitMethod) {
+    case SplitMethod::NAIVE:
+        if (objects.size() <= size_t(maxPrimsInNode))
+            return createLeaf(node, bounds, objects);
+        // Median split, only the middle element has to be in place
+        std::nth_element(objects.begin(), middling, objects.end(),
+                         [&](auto f1, auto f2) {
+                             return centroidOf(f1) < centroidOf(f2);
+                         });
+        break;
+    case SplitMethod::SAH:
+    {
+        // Bin centroids along the widest axis and sweep the bucket
+        // boundaries for the split with the lowest surface area cost
+        constexpr int nBuckets = 12;
+        int counts[nBuckets] = {};
+        Bounds3 bucketBounds[nBuckets];
+        auto bucketOf = [&](Object* obj) {
+            int b = nBuckets * ((centroidOf(obj) - cMin[dim]) /
+                                (cMax[dim] - cMin[dim]));
+            return std::min(b, nBuckets - 1);
+        };
+        for (size_t i = 0; i < objects.size(); ++i) {
+            int b = bucketOf(objects[i]);
+            counts[b]++;
+            bucketBounds[b] = Union(bucketBounds[b], objects[i]->getBounds());
+        }
+
+        // Sweep from the right to get the cost of everything above a split
+        float rightArea[nBuckets];
+        int rightCount[nBuckets];
+        Bounds3 right;
+        int count = 0;
+        for (int i = nBuckets - 1; i > 0; --i) {
+            right = Union(right, bucketBounds[i]);
+            count += counts[i];
+            rightArea[i] = right.SurfaceArea();
+            rightCount[i] = count;
+        }
+
+        float minCost = std::numeric_limits<float>::infinity();
+        int minCostSplit = -1;
+        Bounds3 left;
+        count = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            left = Union(left, bucketBounds[i]);
+            count += counts[i];
+            if (count == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = 0.125f + (count * left.SurfaceArea() +
+                                   rightCount[i + 1] * rightArea[i + 1]) /
+                                      bounds.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplit = i;
+            }
+        }
+
+        // Intersecting every primitive costs 1 per primitive
+        float leafCost = objects.size();
+        if (minCostSplit < 0 ||
+            (objects.size() <= size_t(maxPrimsInNode) && leafCost <= minCost))
+            return createLeaf(node, bounds, objects);
+
+        middling = std::partition(objects.begin(), objects.end(),
+                                  [&](Object* obj) {
+                                      return bucketOf(obj) <= minCostSplit;
+                                  });
+        break;
+    }
+    }
+
+    auto beginning = objects.begin();
+    auto ending = objects.end();
+
+    auto leftshapes = std::vector<Object*>(beginning, middling);
+    auto rightshapes = std::vector<Object*>(middling, ending);
+
+    assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+
+    node->left = recursiveBuild(leftshapes);
+    node->right = recursiveBuild(rightshapes);
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->splitAxis = dim;
+
+    return node;
+}
+
+BVHBuildNode* BVHAccel::createLeaf(BVHBuildNode* node, const Bounds3& bounds,
+                                   const std::vector<Object*>& objects)
+{
+    node->bounds = bounds;
+    node->firstPrimOffset = orderedPrimitives.size();
+    node->nPrimitives = objects.size();
+    for (Object* obj : objects) {
+        orderedPrimitives.push_back(obj);
+    }
+    return node;
+}
+
+void BVHAccel::deleteBuildTree(BVHBuildNode* node)
+{
+    if (node->left)
+        deleteBuildTree(node->left);
+    if (node->right)
+        deleteBuildTree(node->right);
+    delete node;
+}
+
+// Reference to a leaf of the build tree as stored in BVH4Node::child. With
+// triangle leaves its triangles are copied into batches of four.
+int BVHAccel::leafReference(BVHBuildNode* leaf)
+{
+    if (!triangleLeaves)
+        return ~leaf->firstPrimOffset;
+
+    int first = batches.size();
+    for (int i = 0; i < leaf->nPrimitives; i += 4) {
+        TriangleBatch batch;
+        for (int k = 0; k < 4; ++k) {
+            int prim = leaf->firstPrimOffset + std::min(i + k, leaf->nPrimitives - 1);
+            Vector3f v0, e1, e2;
+            primitives[prim]->getTriangle(v0, e1, e2);
+            batch.v0x[k] = v0.x; batch.v0y[k] = v0.y; batch.v0z[k] = v0.z;
+            batch.e1x[k] = e1.x; batch.e1y[k] = e1.y; batch.e1z[k] = e1.z;
+            batch.e2x[k] = e2.x; batch.e2y[k] = e2.y; batch.e2z[k] = e2.z;
+            batch.prim[k] = i + k < leaf->nPrimitives ? prim : -1;
+        }
+        batches.push_back(batch);
+    }
+    return ~first;
+}
+
+// Collapses the subtree of node into 4-wide nodes, stored depth first.
+// Children of node are opened, largest first, until it has four.
+int BVHAccel::collapseBVHTree(BVHBuildNode* node, int depth)
+{
+    maxDepth = std::max(maxDepth, depth);
+    std::vector<BVHBuildNode*> children;
+    if (node->nPrimitives > 0)
+        children.push_back(node);
+    else
+        children = { node->left, node->right };
+    while (children.size() < 4) {
+        int largest = -1;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i]->nPrimitives == 0 &&
+                (largest < 0 || children[i]->bounds.SurfaceArea() > children[largest]->bounds.SurfaceArea()))
+                largest = int(i);
+        }
+        if (largest < 0)
             break;
+        BVHBuildNode* opened = children[largest];
+        children[largest] = opened->left;
+        children.push_back(opened->right);
+    }
+
+    int offset = nodes.size();
+    nodes.emplace_back();
+    BVH4Node wide;
+    wide.nChildren = children.size();
+    for (int i = 0; i < 4; ++i) {
+        // Empty slots get inverted bounds, which no ray enters
+        Bounds3 b;
+        wide.child[i] = 0;
+        wide.nPrimitives[i] = 0;
+        if (i < int(children.size())) {
+            BVHBuildNode* c = children[i];
+            b = c->bounds;
+            if (c->nPrimitives > 0) {
+                wide.child[i] = leafReference(c);
+                wide.nPrimitives[i] = c->nPrimitives;
+            }
+            else {
+                wide.child[i] = collapseBVHTree(c, depth + 1);
+            }
         }
+        wide.minX[i] = b.pMin.x; wide.minY[i] = b.pMin.y; wide.minZ[i] = b.pMin.z;
+        wide.maxX[i] = b.pMax.x; wide.maxY[i] = b.pMax.y; wide.maxZ[i] = b.pMax.z;
+    }
+    nodes[offset] = wide;
+    return offset;
+}
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+// Slab test of one ray against the four children of node, the same test as
+// Bounds3::IntersectP. Returns the mask of the children that overlap
+// [tMin, tMax), with their entry distances in tEnter.
+static int intersectChildren(const BVH4Node& node, const Vector3f& org, const Vector3f& invDir,
+                             const std::array<int, 3>& dirIsNeg, float tMin, float tMax,
+                             float* tEnter)
+{
+    const float* nearX = dirIsNeg[0] ? node.minX : node.maxX;
+    const float* farX = dirIsNeg[0] ? node.maxX : node.minX;
+    const float* nearY = dirIsNeg[1] ? node.minY : node.maxY;
+    const float* farY = dirIsNeg[1] ? node.maxY : node.minY;
+    const float* nearZ = dirIsNeg[2] ? node.minZ : node.maxZ;
+    const float* farZ = dirIsNeg[2] ? node.maxZ : node.minZ;
+#if defined(__SSE2__)
+    auto plane = [](const float* p, float o, float inv) {
+        return _mm_mul_ps(_mm_sub_ps(_mm_load_ps(p), _mm_set1_ps(o)), _mm_set1_ps(inv));
+    };
+    __m128 enter = plane(nearX, org.x, invDir.x);
+    __m128 exit = plane(farX, org.x, invDir.x);
+    enter = _mm_max_ps(plane(nearY, org.y, invDir.y), enter);
+    exit = _mm_min_ps(plane(farY, org.y, invDir.y), exit);
+    enter = _mm_max_ps(plane(nearZ, org.z, invDir.z), enter);
+    exit = _mm_min_ps(plane(farZ, org.z, invDir.z), exit);
+    __m128 inside = _mm_and_ps(_mm_cmple_ps(enter, exit), _mm_cmpgt_ps(exit, _mm_set1_ps(tMin)));
+    inside = _mm_and_ps(inside, _mm_cmplt_ps(enter, _mm_set1_ps(tMax)));
+    _mm_store_ps(tEnter, enter);
+    int hit = _mm_movemask_ps(inside);
+#else
+    int hit = 0;
+    for (int i = 0; i < 4; ++i) {
+        float enter = (nearX[i] - org.x) * invDir.x, exit = (farX[i] - org.x) * invDir.x;
+        enter = std::max(enter, (nearY[i] - org.y) * invDir.y);
+        exit = std::min(exit, (farY[i] - org.y) * invDir.y);
+        enter = std::max(enter, (nearZ[i] - org.z) * invDir.z);
+        exit = std::min(exit, (farZ[i] - org.z) * invDir.z);
+        tEnter[i] = enter;
+        if (enter <= exit && exit > tMin && enter < tMax)
+            hit |= 1 << i;
+    }
+#endif
+    return hit & ((1 << node.nChildren) - 1);
+}
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+// Moller-Trumbore test of one ray against the four triangles of a batch,
+// front faces only, as in Triangle::getIntersection. The determinant is
+// positive for front faces, so the normal is not needed. Returns the mask
+// of the triangles hit within [tMin, tMax), with their distances in t.
+static int intersectBatch(const TriangleBatch& b, const Vector3f& org, const Vector3f& dir,
+                          float tMin, float tMax, float* t)
+{
+#if defined(__SSE2__)
+    __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+    __m128 e1x = _mm_load_ps(b.e1x), e1y = _mm_load_ps(b.e1y), e1z = _mm_load_ps(b.e1z);
+    __m128 e2x = _mm_load_ps(b.e2x), e2y = _mm_load_ps(b.e2y), e2z = _mm_load_ps(b.e2z);
+    auto mul = [](__m128 a, __m128 c) { return _mm_mul_ps(a, c); };
+    auto dot = [&](__m128 ax, __m128 ay, __m128 az, __m128 cx, __m128 cy, __m128 cz) {
+        return _mm_add_ps(_mm_add_ps(mul(ax, cx), mul(ay, cy)), mul(az, cz));
+    };
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 px = _mm_sub_ps(mul(dy, e2z), mul(dz, e2y));
+    __m128 py = _mm_sub_ps(mul(dz, e2x), mul(dx, e2z));
+    __m128 pz = _mm_sub_ps(mul(dx, e2y), mul(dy, e2x));
+    __m128 det = dot(e1x, e1y, e1z, px, py, pz);
+    __m128 valid = _mm_cmpgt_ps(det, zero);
+    __m128 detInv = _mm_div_ps(one, det);
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(org.x), _mm_load_ps(b.v0x));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(org.y), _mm_load_ps(b.v0y));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(org.z), _mm_load_ps(b.v0z));
+    __m128 u = mul(dot(tx, ty, tz, px, py, pz), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    __m128 qx = _mm_sub_ps(mul(ty, e1z), mul(tz, e1y));
+    __m128 qy = _mm_sub_ps(mul(tz, e1x), mul(tx, e1z));
+    __m128 qz = _mm_sub_ps(mul(tx, e1y), mul(ty, e1x));
+    __m128 v = mul(dot(dx, dy, dz, qx, qy, qz), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+    __m128 tHit = mul(dot(e2x, e2y, e2z, qx, qy, qz), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tHit, _mm_set1_ps(tMin)),
+                                         _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+    _mm_storeu_ps(t, tHit);
+    int hit = _mm_movemask_ps(valid);
+#else
+    int hit = 0;
+    for (int k = 0; k < 4; ++k) {
+        Vector3f e1(b.e1x[k], b.e1y[k], b.e1z[k]), e2(b.e2x[k], b.e2y[k], b.e2z[k]);
+        Vector3f pvec = crossProduct(dir, e2);
+        float det = dotProduct(e1, pvec);
+        if (det <= 0)
+            continue;
+        float detInv = 1.f / det;
+        Vector3f tvec = org - Vector3f(b.v0x[k], b.v0y[k], b.v0z[k]);
+        float u = dotProduct(tvec, pvec) * detInv;
+        if (u < 0 || u > 1)
+            continue;
+        Vector3f qvec = crossProduct(tvec, e1);
+        float v = dotProduct(dir, qvec) * detInv;
+        if (v < 0 || u + v > 1)
+            continue;
+        t[k] = dotProduct(e2, qvec) * detInv;
+        if (t[k] >= tMin && t[k] < tMax)
+            hit |= 1 << k;
     }
+#endif
+    // Padding lanes repeat the last triangle, drop them
+    for (int k = 0; k < 4; ++k)
+        if (b.prim[k] < 0)
+            hit &= ~(1 << k);
+    return hit;
+}
 
-    return node;
+// Traversal stack for a 4-wide tree maxDepth levels deep. Each interior node
+// on the way down replaces its own entry with at most four children, so three
+// entries per level and the root always fit. Trees too deep for the caller's
+// fixed array get one on the heap.
+template <typename Entry, size_t N>
+static Entry* traversalStack(int maxDepth, Entry (&fixed)[N], std::vector<Entry>& heap)
+{
+    size_t size = 3 * size_t(maxDepth) + 1;
+    if (size <= N)
+        return fixed;
+    heap.resize(size);
+    return heap.data();
 }
 
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
     Intersection isect;
-    if (!root)
+    if (nodes.empty())
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
+
+    Vector3f dir = ray.direction, invDir = ray.direction_inv;
+    // Signs of the inverse, which unlike the direction are right for zero
+    // components too
+    std::array<int, 3> dirIsNeg = { int(invDir.x > 0), int(invDir.y > 0), int(invDir.z > 0) };
+    // ray.t_max, the distance of the closest hit so far. Triangle leaves only
+    // record which triangle it is, its hit record is made once the traversal
+    // is done.
+    float tMin = ray.t_min, tMax = ray.t_max;
+    int hitPrimitive = -1;
+    // Children still to visit, with the distance at which the ray enters them
+    struct StackEntry { int child, nPrimitives; float tEnter; };
+    StackEntry fixedStack[128];
+    std::vector<StackEntry> heapStack;
+    StackEntry* toVisit = traversalStack(maxDepth, fixedStack, heapStack);
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = { 0, 0, 0.f };
+    while (toVisitOffset > 0) {
+        StackEntry entry = toVisit[--toVisitOffset];
+        // Skip children that start beyond the closest hit found so far
+        if (entry.tEnter >= tMax)
+            continue;
+
+        if (entry.child < 0) {
+            int first = ~entry.child;
+            if (triangleLeaves) {
+                for (int b = first; b < first + (entry.nPrimitives + 3) / 4; ++b) {
+                    alignas(16) float t[4];
+                    int hit = intersectBatch(batches[b], ray.origin, dir, tMin, tMax, t);
+                    for (int k = 0; k < 4; ++k) {
+                        if ((hit >> k & 1) && t[k] < tMax) {
+                            tMax = t[k];
+                            hitPrimitive = batches[b].prim[k];
+                        }
+                    }
+                }
+            }
+            else {
+                // Primitives only report hits before ray.t_max and shrink it
+                for (int i = first; i < first + entry.nPrimitives; ++i) {
+                    Intersection hit = primitives[i]->getIntersection(ray);
+                    if (hit.happened)
+                        isect = hit;
+                }
+                tMax = ray.t_max;
+            }
+            continue;
+        }
+
+        const BVH4Node& node = nodes[entry.child];
+        alignas(16) float tEnter[4];
+        int hit = intersectChildren(node, ray.origin, invDir, dirIsNeg, tMin, tMax, tEnter);
+        // Push far to near, so the nearest child is visited next
+        int order[4], count = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(hit >> i & 1))
+                continue;
+            int j = count++;
+            for (; j > 0 && tEnter[order[j - 1]] < tEnter[i]; --j)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+        for (int k = 0; k < count; ++k) {
+            int i = order[k];
+            toVisit[toVisitOffset++] = { node.child[i], node.nPrimitives[i], tEnter[i] };
+        }
+    }
+    ray.t_max = tMax;
+    if (hitPrimitive >= 0)
+        isect = primitives[hitPrimitive]->getIntersectionAt(ray, tMax);
     return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectP(const Ray& ray) const
 {
-    // TODO Traverse the BVH to find intersection
-    Vector3f dir = ray.direction;
-    std::array<int, 3> dirIsNeg = { int(dir.x > 0), int(dir.y > 0), int(dir.z > 0) };
-    Intersection isect;
-    if (!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg)) {
-        return isect;
-    }
-    if (node->object != nullptr) {
-        return node->object->getIntersection(ray);
+    if (nodes.empty())
+        return false;
+
+    Vector3f dir = ray.direction, invDir = ray.direction_inv;
+    // Signs of the inverse, which unlike the direction are right for zero
+    // components too
+    std::array<int, 3> dirIsNeg = { int(invDir.x > 0), int(invDir.y > 0), int(invDir.z > 0) };
+    float tMin = ray.t_min, tMax = ray.t_max;
+    // Any blocker will do, so children are visited in whatever order
+    struct StackEntry { int child, nPrimitives; };
+    StackEntry fixedStack[128];
+    std::vector<StackEntry> heapStack;
+    StackEntry* toVisit = traversalStack(maxDepth, fixedStack, heapStack);
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = { 0, 0 };
+    while (toVisitOffset > 0) {
+        StackEntry entry = toVisit[--toVisitOffset];
+        if (entry.child < 0) {
+            int first = ~entry.child;
+            if (triangleLeaves) {
+                for (int b = first; b < first + (entry.nPrimitives + 3) / 4; ++b) {
+                    alignas(16) float t[4];
+                    if (intersectBatch(batches[b], ray.origin, dir, tMin, tMax, t))
+                        return true;
+                }
+            }
+            else {
+                for (int i = first; i < first + entry.nPrimitives; ++i) {
+                    if (primitives[i]->intersectP(ray))
+                        return true;
+                }
+            }
+            continue;
+        }
+
+        const BVH4Node& node = nodes[entry.child];
+        alignas(16) float tEnter[4];
+        int hit = intersectChildren(node, ray.origin, invDir, dirIsNeg, tMin, tMax, tEnter);
+        for (int i = 0; i < node.nChildren; ++i) {
+            if (hit >> i & 1)
+                toVisit[toVisitOffset++] = { node.child[i], node.nPrimitives[i] };
+        }
     }
-    Intersection isectLeft = getIntersection(node->left, ray);
-    Intersection isectRight = getIntersection(node->right, ray);
-    if (isectLeft.happened) isect = isectLeft;
-    if (isectRight.happened && isectRight.distance < isect.distance) isect = isectRight;
-    return isect;
+    return false;
 }
 
-
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+void BVHAccel::Intersect(RayPacket& packet, int mask, Intersection* hits) const
+{
+    if (nodes.empty() || mask == 0)
         return;
+
+    // The rays of a packet are coherent, so all of them visit the children
+    // in the near to far order of the first one
+    int first = 0;
+    while (!(mask >> first & 1))
+        ++first;
+    Vector3f firstOrigin = packet.origin(first);
+    Vector3f firstInvDir(packet.ix[first], packet.iy[first], packet.iz[first]);
+    std::array<int, 3> dirIsNeg = { int(firstInvDir.x > 0), int(firstInvDir.y > 0),
+                                    int(firstInvDir.z > 0) };
+    // Children still to visit as node and slot, with the lanes that reached
+    // their parent. Children are tested when they are taken off the stack,
+    // so hits found in the meantime cull them.
+    struct StackEntry { int node, slot, mask; };
+    StackEntry fixedStack[128];
+    std::vector<StackEntry> heapStack;
+    StackEntry* toVisit = traversalStack(maxDepth, fixedStack, heapStack);
+    int toVisitOffset = 0;
+    int currentNode = 0, currentMask = mask;
+    // Triangle hit by every lane, whose hit record is made at the end
+    int hitPrimitive[RayPacket::size];
+    std::fill(hitPrimitive, hitPrimitive + RayPacket::size, -1);
+    while (true) {
+        const BVH4Node& node = nodes[currentNode];
+        alignas(16) float tEnter[4];
+        intersectChildren(node, firstOrigin, firstInvDir, dirIsNeg, packet.tMin[first],
+                          std::numeric_limits<float>::infinity(), tEnter);
+        // Push far to near, so the nearest child is visited next
+        int order[4];
+        for (int i = 0; i < node.nChildren; ++i) {
+            int j = i;
+            for (; j > 0 && tEnter[order[j - 1]] < tEnter[i]; --j)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+        for (int k = 0; k < node.nChildren; ++k)
+            toVisit[toVisitOffset++] = { currentNode, order[k], currentMask };
+
+        // Take children off the stack until one is an interior node
+        currentNode = -1;
+        while (toVisitOffset > 0 && currentNode < 0) {
+            StackEntry entry = toVisit[--toVisitOffset];
+            const BVH4Node& parent = nodes[entry.node];
+            int slot = entry.slot;
+            int active = ::IntersectP(Vector3f(parent.minX[slot], parent.minY[slot], parent.minZ[slot]),
+                                      Vector3f(parent.maxX[slot], parent.maxY[slot], parent.maxZ[slot]),
+                                      packet, entry.mask);
+            if (!active)
+                continue;
+            if (!parent.isLeaf(slot)) {
+                currentNode = parent.child[slot];
+                currentMask = active;
+                continue;
+            }
+
+            int offset = ~parent.child[slot];
+            int nPrimitives = parent.nPrimitives[slot];
+            if (triangleLeaves) {
+                for (int b = offset; b < offset + (nPrimitives + 3) / 4; ++b) {
+                    const TriangleBatch& batch = batches[b];
+                    for (int k = 0; k < 4 && batch.prim[k] >= 0; ++k) {
+                        alignas(16) float t[RayPacket::size];
+                        int hit = IntersectTriangle(Vector3f(batch.v0x[k], batch.v0y[k], batch.v0z[k]),
+                                                    Vector3f(batch.e1x[k], batch.e1y[k], batch.e1z[k]),
+                                                    Vector3f(batch.e2x[k], batch.e2y[k], batch.e2z[k]),
+                                                    packet, active, t);
+                        for (int i = 0; hit; ++i, hit >>= 1) {
+                            if (!(hit & 1))
+                                continue;
+                            hitPrimitive[i] = batch.prim[k];
+                            packet.tMax[i] = t[i];
+                        }
+                    }
+                }
+            }
+            else {
+                for (int i = offset; i < offset + nPrimitives; ++i)
+                    primitives[i]->getIntersections(packet, active, hits);
+            }
+        }
+        if (currentNode < 0)
+            break;
+    }
+
+    for (int i = 0; i < RayPacket::size; ++i) {
+        if (hitPrimitive[i] >= 0)
+            hits[i] = primitives[hitPrimitive[i]]->getIntersectionAt(packet.ray(i), packet.tMax[i]);
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+void BVHAccel::Sample(Intersection &pos, float &pdf, Sampler &sampler){
+    // Pick a primitive by area, then a uniform point on it
+    float u1 = sampler.get_float(), u2 = sampler.get_float();
+    int k = primitiveDistribution.sample(u1, u2);
+    if (k < 0) {
+        pdf = 0;
+        return;
+    }
+    primitives[k]->Sample(pos, pdf, sampler);
+    pdf = 1.0f / totalArea;
+}
@@ -9,13 +9,18 @@
 #include <vector>
 #include <memory>
 #include <ctime>
+#include <cstdint>
 #include "Object.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "AliasTable.hpp"
 
 struct BVHBuildNode;
+struct BVH4Node;
+struct TriangleBatch;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
@@ -28,33 +33,51 @@ public:
     enum class SplitMethod { NAIVE, SAH };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 4, SplitMethod splitMethod = SplitMethod::SAH);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // Closest hits of the lanes in mask, which are traced down the tree
+    // together. hits holds the closest hits so far and is updated.
+    void Intersect(RayPacket &packet, int mask, Intersection *hits) const;
+    // Occlusion query: whether anything is hit within the ray's interval.
+    // Returns at the first blocker found and makes no hit record.
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
 
     // BVHAccel Private Methods
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    int collapseBVHTree(BVHBuildNode* node, int depth = 1);
+    int leafReference(BVHBuildNode* leaf);
+    void deleteBuildTree(BVHBuildNode* node);
+    BVHBuildNode* createLeaf(BVHBuildNode* node, const Bounds3& bounds,
+                             const std::vector<Object*>& objects);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
-
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+    std::vector<Object*> orderedPrimitives;
+    // The binary build tree collapsed into a 4-wide tree for traversal
+    std::vector<BVH4Node> nodes;
+    int totalNodes = 0;
+    // Levels of the 4-wide tree, which bound the traversal stacks
+    int maxDepth = 0;
+    // When every primitive is a Triangle, leaves refer to runs of batches
+    // in here instead of to primitives
+    bool triangleLeaves = false;
+    std::vector<TriangleBatch> batches;
+    // Area weighted choice of primitives for Sample
+    AliasTable primitiveDistribution;
+    float totalArea = 0;
+
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler);
 };
 
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
-    float area;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -62,11 +85,34 @@ public:
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
+// Up to four children with their bounds in SoA layout, so that a ray is
+// tested against all of them with one SSE slab test
+struct alignas(16) BVH4Node {
+    float minX[4], minY[4], minZ[4];
+    float maxX[4], maxY[4], maxZ[4];
+    // Interior child: index of its node. Leaf child: ~offset of its first
+    // primitive, or of its first batch with triangle leaves.
+    int child[4];
+    // Primitives of a leaf child, 0 for interior children
+    int nPrimitives[4];
+    int nChildren;
+
+    bool isLeaf(int i) const { return child[i] < 0; }
+};
 
-
+// Four triangles of a leaf in SoA layout, with only what the intersection
+// test reads: vertex v0 and edges e1 = v1 - v0 and e2 = v2 - v0. prim holds
+// the primitive index of every triangle, -1 past the end of the leaf; the
+// Triangle itself is only read for the closest hit.
+struct alignas(16) TriangleBatch {
+    float v0x[4], v0y[4], v0z[4];
+    float e1x[4], e1y[4], e1z[4];
+    float e2x[4], e2y[4], e2z[4];
+    int prim[4];
+};
+static_assert(sizeof(TriangleBatch) == 160, "TriangleBatch should take 40 bytes per triangle");
 
 #endif //RAYTRACING_BVH_H
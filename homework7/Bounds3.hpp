@@ -128,7 +128,8 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
         tExit = std::min(tExit, (minZ - ray.origin.z) * invDir.z);
     }
 
-    return tEnter <= tExit && tExit > 0;
+    // The box is missed when it lies outside the ray's [t_min, t_max)
+    return tEnter <= tExit && tExit > ray.t_min && tEnter < ray.t_max;
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
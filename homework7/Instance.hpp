@@ -0,0 +1,121 @@
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include <cassert>
+#include "Object.hpp"
+#include "Transform.hpp"
+
+// A placement of a shared object, usually a MeshTriangle with its own
+// bottom level BVH. The scene BVH is built over instances, and rays are
+// moved into object space before they reach the prototype, so one mesh
+// can be placed many times without copying its triangles.
+class Instance : public Object
+{
+public:
+    Object* prototype;
+    Transform objectToWorld, worldToObject;
+    float areaScale;
+
+    Instance(Object* p, const Transform& t)
+        : prototype(p), objectToWorld(t), worldToObject(t.Inverse())
+    {
+        // Areas, and so getArea and the pdf of Sample, are only scaled by a
+        // single factor under rigid motions and uniform scales
+        assert(t.IsSimilarity() && "Instance transforms must not scale non-uniformly");
+        areaScale = std::pow(std::fabs(t.Determinant()), 2.f / 3.f);
+    }
+
+    bool intersect(const Ray& ray) override
+    {
+        return prototype->intersect(toObject(ray));
+    }
+
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override
+    {
+        // The direction is not normalized in object space, so t carries over
+        return prototype->intersect(toObject(ray), tnear, index);
+    }
+
+    Intersection getIntersection(const Ray& ray) override
+    {
+        Ray local = toObject(ray);
+        Intersection inter = prototype->getIntersection(local);
+        if (!inter.happened)
+            return inter;
+        ray.t_max = local.t_max;
+        inter.coords = ray(inter.distance);
+        inter.normal = normalize(worldToObject.Normal(inter.normal));
+        return inter;
+    }
+
+    bool intersectP(const Ray& ray) override
+    {
+        return prototype->intersectP(toObject(ray));
+    }
+
+    void getIntersections(RayPacket& packet, int mask, Intersection* hits) override
+    {
+        RayPacket local;
+        for (int i = 0; i < packet.count; ++i)
+            local.push(toObject(packet.ray(i)));
+        Intersection localHits[RayPacket::size];
+        prototype->getIntersections(local, mask, localHits);
+        for (int i = 0; i < packet.count; ++i) {
+            if (!localHits[i].happened)
+                continue;
+            // Only hits closer than tMax are reported, so these replace hits[i]
+            hits[i] = localHits[i];
+            hits[i].coords = packet.ray(i)(hits[i].distance);
+            hits[i].normal = normalize(worldToObject.Normal(hits[i].normal));
+            packet.tMax[i] = local.tMax[i];
+        }
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                              const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const override
+    {
+        prototype->getSurfaceProperties(worldToObject.Point(P),
+                                        worldToObject.Direction(I), index, uv,
+                                        N, st);
+        N = normalize(worldToObject.Normal(N));
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f& st) const override
+    {
+        return prototype->evalDiffuseColor(st);
+    }
+
+    Bounds3 getBounds() override
+    {
+        return objectToWorld.Bounds(prototype->getBounds());
+    }
+
+    float getArea() override
+    {
+        return prototype->getArea() * areaScale;
+    }
+
+    void Sample(Intersection& pos, float& pdf, Sampler& sampler) override
+    {
+        prototype->Sample(pos, pdf, sampler);
+        pos.coords = objectToWorld.Point(pos.coords);
+        pos.normal = normalize(worldToObject.Normal(pos.normal));
+        pdf /= areaScale;
+    }
+
+    bool hasEmit() override
+    {
+        return prototype->hasEmit();
+    }
+
+private:
+    Ray toObject(const Ray& ray) const
+    {
+        // The direction is not normalized, so the interval carries over
+        return Ray(worldToObject.Point(ray.origin),
+                   worldToObject.Direction(ray.direction), ray.t, ray.t_min, ray.t_max);
+    }
+};
+
+#endif //RAYTRACING_INSTANCE_H
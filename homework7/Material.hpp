@@ -6,6 +6,7 @@
 #define RAYTRACING_MATERIAL_H
 
 #include "Vector.hpp"
+#include "global.hpp"
 
 enum MaterialType { DIFFUSE, MICROFACET};
 
@@ -71,8 +72,7 @@ private:
         // kt = 1 - kr;
     }
 
-    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
-        Vector3f B, C;
+    void makeBasis(const Vector3f &N, Vector3f &B, Vector3f &C){
         if (std::fabs(N.x) > std::fabs(N.y)){
             float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
             C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
@@ -82,9 +82,58 @@ private:
             C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
         }
         B = crossProduct(C, N);
+    }
+
+    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        makeBasis(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
 
+    Vector3f toLocal(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        makeBasis(N, B, C);
+        return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+    }
+
+    // cosine weighted direction on the hemisphere around z
+    Vector3f sampleCosineHemisphere(float x_1, float x_2){
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.0f - x_1)));
+    }
+
+    // GGX normal visible from V, both in the local frame (Heitz 2018)
+    Vector3f sampleGGXVNDF(const Vector3f &V, float x_1, float x_2){
+        Vector3f Vh = normalize(Vector3f(rough * V.x, rough * V.y, V.z));
+        float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+        Vector3f T1 = lensq > 0 ? Vector3f(-Vh.y, Vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+        Vector3f T2 = crossProduct(Vh, T1);
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+        float s = 0.5f * (1.0f + Vh.z);
+        t2 = (1.0f - s) * std::sqrt(1.0f - t1 * t1) + s * t2;
+        Vector3f Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
+        return normalize(Vector3f(rough * Nh.x, rough * Nh.y, std::max(0.f, Nh.z)));
+    }
+
+    // Exact Smith masking of GGX, the one the visible normals follow
+    float getSmithG1GGX(float NdotV) {
+        float rough2 = rough * rough;
+        return 2 * NdotV / (NdotV + std::sqrt(rough2 + (1 - rough2) * NdotV * NdotV));
+    }
+
+    // Probability of sampling the specular lobe of a MICROFACET material,
+    // proportional to the weights eval gives both lobes
+    float getSpecularProbability(const Vector3f &wi, const Vector3f &N){
+        if (dotProduct(-wi, N) <= 0.0f) return 0.0f;
+        float kr;
+        fresnel(wi, N, ior, kr);
+        float spec = kr * (Ks.x + Ks.y + Ks.z);
+        float diff = (1 - kr) * (Kd.x + Kd.y + Kd.z);
+        if (spec + diff <= 0.0f) return 0.5f;
+        return clamp(0.1f, 0.9f, spec / (spec + diff));
+    }
+
     float getD_GGX_TR(const Vector3f& I, const Vector3f& V, const Vector3f& N) {
         Vector3f m = (I + V).normalized();
         float rough2 = rough * rough;
@@ -127,7 +176,7 @@ public:
     inline bool hasEmission();
 
     // sample a ray by Material properties
-    inline Vector3f sample(const Vector3f &wi, const Vector3f &N);
+    inline Vector3f sample(const Vector3f &wi, const Vector3f &N, Sampler &sampler);
     // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
     // given a ray, calculate the contribution of this ray
@@ -154,27 +203,27 @@ Vector3f Material::getColorAt(double u, double v) {
 }
 
 
-Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
+Vector3f Material::sample(const Vector3f &wi, const Vector3f &N, Sampler &sampler){
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample on the hemisphere
-            float x_1 = get_random_float(), x_2 = get_random_float();
-            float z = std::fabs(1.0f - 2.0f * x_1);
-            float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-            Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
-            return toWorld(localRay, N);
-            
+            // cosine weighted sample on the hemisphere
+            float x_1 = sampler.get_float(), x_2 = sampler.get_float();
+            return toWorld(sampleCosineHemisphere(x_1, x_2), N);
+
             break;
         }
         case MICROFACET:
         {
-            // uniform sample on the hemisphere
-            float x_1 = get_random_float(), x_2 = get_random_float();
-            float z = std::fabs(1.0f - 2.0f * x_1);
-            float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-            Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-            return toWorld(localRay, N);
+            // pick a lobe, then sample GGX visible normals or the cosine
+            float x_1 = sampler.get_float(), x_2 = sampler.get_float();
+            if (sampler.get_float() < getSpecularProbability(wi, N)) {
+                Vector3f V = toLocal(-wi, N);
+                Vector3f m = sampleGGXVNDF(V, x_1, x_2);
+                Vector3f localRay = 2.0f * dotProduct(V, m) * m - V;
+                return toWorld(localRay, N);
+            }
+            return toWorld(sampleCosineHemisphere(x_1, x_2), N);
 
             break;
         }
@@ -185,20 +234,28 @@ float Material::pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample probability 1 / (2 * PI)
-            if (dotProduct(wo, N) > 0.0f)
-                return 0.5f / M_PI;
+            // cosine weighted probability cos(theta) / PI
+            float cosTheta = dotProduct(wo, N);
+            if (cosTheta > 0.0f)
+                return cosTheta / M_PI;
             else
                 return 0.0f;
             break;
         }
         case MICROFACET:
         {
-            // uniform sample probability 1 / (2 * PI)
-            if (dotProduct(wo, N) > 0.0f)
-                return 0.5f / M_PI;
-            else
+            float cosTheta = dotProduct(wo, N);
+            if (cosTheta <= 0.0f)
                 return 0.0f;
+            float pSpec = getSpecularProbability(wi, N);
+            float pdfDiffuse = cosTheta / M_PI;
+            float pdfSpecular = 0.0f;
+            if (pSpec > 0.0f) {
+                // D_V(m) / (4 V.m) with D_V(m) = G1(V) V.m D(m) / N.V
+                float NdotV = dotProduct(-wi, N);
+                pdfSpecular = getSmithG1GGX(NdotV) * getD_GGX_TR(-wi, wo, N) / (4 * NdotV);
+            }
+            return pSpec * pdfSpecular + (1 - pSpec) * pdfDiffuse;
             break;
         }
     }
@@ -228,11 +285,12 @@ Vector3f Material::eval(const Vector3f &wi, const Vector3f &wo, const Vector3f &
             float D = getD_GGX_TR(-wi, wo, N);
             float G = getGeometrySmith(-wi, wo, N);
             float nom = D * kr * G;
-            float denom = 4 * std::max(dotProduct(wo, N), 0.f) * std::max(dotProduct(wi, N), 0.f);
+            // wi points towards the surface, so the light side cosine is -wi.N
+            float denom = 4 * std::max(dotProduct(wo, N), 0.f) * std::max(dotProduct(-wi, N), 0.f);
 
             Vector3f diffuse = (Vector3f(1.0f) - kr) / M_PI;
 
-            if (denom < 0.001) return Kd * diffuse + Ks * Vector3f(1.0f);
+            if (denom < 0.001) return Kd * diffuse;
             return Kd * diffuse + Ks * nom / denom;
         }
     }
@@ -10,6 +10,7 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 
 class Object
 {
@@ -18,12 +19,36 @@ public:
     virtual ~Object() {}
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
-    virtual Intersection getIntersection(Ray _ray) = 0;
+    // Closest hit within [ray.t_min, ray.t_max), which shrinks ray.t_max
+    virtual Intersection getIntersection(const Ray& ray) = 0;
+    // Packet version of getIntersection for the lanes in mask. hits and
+    // packet.tMax hold the closest hit of every lane so far and are only
+    // updated by closer hits.
+    virtual void getIntersections(RayPacket& packet, int mask, Intersection* hits)
+    {
+        for (int i = 0; i < RayPacket::size; ++i) {
+            if (!(mask >> i & 1))
+                continue;
+            Ray ray = packet.ray(i);
+            Intersection hit = getIntersection(ray);
+            if (hit.happened) {
+                hits[i] = hit;
+                packet.tMax[i] = ray.t_max;
+            }
+        }
+    }
+    // Whether the ray hits the object within its interval, for shadow rays
+    virtual bool intersectP(const Ray& ray) { return getIntersection(ray).happened; }
+    // Hit record of a ray known to hit the object at distance t
+    virtual Intersection getIntersectionAt(const Ray& ray, float t) { return getIntersection(ray); }
+    // Triangles return their first vertex and the edges to the other two,
+    // so that a BVH over them can store them in batches
+    virtual bool getTriangle(Vector3f& v0, Vector3f& e1, Vector3f& e2) const { return false; }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
-    virtual void Sample(Intersection &pos, float &pdf)=0;
+    virtual void Sample(Intersection &pos, float &pdf, Sampler &sampler)=0;
     virtual bool hasEmit()=0;
 };
 
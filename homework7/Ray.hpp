@@ -10,12 +10,16 @@ struct Ray{
     Vector3f origin;
     Vector3f direction, direction_inv;
     double t;//transportation time,
-    double t_min, t_max;
+    // Only hits in [t_min, t_max) count. Intersection routines shrink t_max
+    // to every closer hit they find, so that what lies beyond it is culled.
+    float t_min;
+    mutable float t_max;
 
-    Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0): origin(ori), direction(dir),t(_t) {
+    Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0, float tMin = 0.0f,
+        float tMax = std::numeric_limits<float>::infinity()): origin(ori), direction(dir),t(_t) {
         direction_inv = Vector3f(1./direction.x, 1./direction.y, 1./direction.z);
-        t_min = 0.0;
-        t_max = std::numeric_limits<double>::max();
+        t_min = tMin;
+        t_max = tMax;
 
     }
 
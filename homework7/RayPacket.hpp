@@ -0,0 +1,171 @@
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include <cmath>
+#include <limits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "Ray.hpp"
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// Up to size rays traced together in SoA layout, so that one SSE
+// instruction works on four of them. Lanes are selected by bit masks; lane
+// i takes part in a test when bit i of the mask is set.
+struct RayPacket
+{
+    static constexpr int size = 8;
+    static_assert(size % 4 == 0 && size <= 32, "packets are made of whole SSE groups");
+
+    alignas(16) float ox[size] = {}, oy[size] = {}, oz[size] = {};
+    alignas(16) float dx[size] = {}, dy[size] = {}, dz[size] = {};
+    alignas(16) float ix[size] = {}, iy[size] = {}, iz[size] = {};
+    // Interval of every lane, as Ray::t_min and Ray::t_max. tMax shrinks to
+    // the closest hit found so far.
+    alignas(16) float tMin[size] = {};
+    alignas(16) float tMax[size] = {};
+    int count = 0;
+
+    // Adds r as the next lane
+    void push(const Ray& r)
+    {
+        int i = count++;
+        ox[i] = r.origin.x; oy[i] = r.origin.y; oz[i] = r.origin.z;
+        dx[i] = r.direction.x; dy[i] = r.direction.y; dz[i] = r.direction.z;
+        ix[i] = r.direction_inv.x; iy[i] = r.direction_inv.y; iz[i] = r.direction_inv.z;
+        tMin[i] = r.t_min;
+        tMax[i] = r.t_max;
+    }
+
+    int mask() const { return count >= 32 ? -1 : (1 << count) - 1; }
+
+    Vector3f origin(int i) const { return Vector3f(ox[i], oy[i], oz[i]); }
+    Vector3f direction(int i) const { return Vector3f(dx[i], dy[i], dz[i]); }
+    Ray ray(int i) const { return Ray(origin(i), direction(i), 0.0, tMin[i], tMax[i]); }
+};
+
+// Slab test of all lanes in mask against the box [pMin, pMax], the packet
+// version of Bounds3::IntersectP. Returns the mask of the lanes whose
+// [tMin, tMax) overlaps the box.
+inline int IntersectP(const Vector3f& pMin, const Vector3f& pMax, const RayPacket& p, int mask)
+{
+    int hit = 0;
+    for (int k = 0; k < RayPacket::size; k += 4) {
+        if (((mask >> k) & 0xf) == 0)
+            continue;
+#if defined(__SSE2__)
+        __m128 zero = _mm_setzero_ps();
+        auto slab = [&](float lo, float hi, const float* o, const float* inv,
+                        __m128& tEnter, __m128& tExit, bool first) {
+            __m128 org = _mm_load_ps(o + k), invDir = _mm_load_ps(inv + k);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(lo), org), invDir);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(hi), org), invDir);
+            // Lanes going in the negative direction enter at the far plane.
+            // The sign is taken from the inverse, which is also right for a
+            // zero component, where it is +-inf.
+            __m128 pos = _mm_cmpgt_ps(invDir, zero);
+            __m128 enter = _mm_or_ps(_mm_and_ps(pos, t0), _mm_andnot_ps(pos, t1));
+            __m128 exit = _mm_or_ps(_mm_and_ps(pos, t1), _mm_andnot_ps(pos, t0));
+            if (first) {
+                tEnter = enter;
+                tExit = exit;
+            }
+            else {
+                // Same NaN behaviour as std::max(tEnter, enter) in the scalar test
+                tEnter = _mm_max_ps(enter, tEnter);
+                tExit = _mm_min_ps(exit, tExit);
+            }
+        };
+        __m128 tEnter, tExit;
+        slab(pMin.x, pMax.x, p.ox, p.ix, tEnter, tExit, true);
+        slab(pMin.y, pMax.y, p.oy, p.iy, tEnter, tExit, false);
+        slab(pMin.z, pMax.z, p.oz, p.iz, tEnter, tExit, false);
+        __m128 inside = _mm_and_ps(_mm_cmple_ps(tEnter, tExit), _mm_cmpgt_ps(tExit, _mm_load_ps(p.tMin + k)));
+        inside = _mm_and_ps(inside, _mm_cmplt_ps(tEnter, _mm_load_ps(p.tMax + k)));
+        hit |= _mm_movemask_ps(inside) << k;
+#else
+        for (int i = k; i < k + 4; ++i) {
+            std::array<int, 3> dirIsNeg = { int(p.ix[i] > 0), int(p.iy[i] > 0), int(p.iz[i] > 0) };
+            Bounds3 b;
+            b.pMin = pMin;
+            b.pMax = pMax;
+            if (b.IntersectP(p.ray(i), Vector3f(p.ix[i], p.iy[i], p.iz[i]), dirIsNeg))
+                hit |= 1 << i;
+        }
+#endif
+    }
+    return hit & mask;
+}
+
+// Moller-Trumbore test of the lanes in mask against the triangle
+// (v0, v0 + e1, v0 + e2), seen from the front side only, where the
+// determinant is positive. Lanes that hit it within [tMin, tMax) get their
+// distance in t and are returned as a mask.
+inline int IntersectTriangle(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2,
+                             const RayPacket& p, int mask, float* t)
+{
+    int hit = 0;
+    for (int k = 0; k < RayPacket::size; k += 4) {
+        if (((mask >> k) & 0xf) == 0)
+            continue;
+#if defined(__SSE2__)
+        __m128 dx = _mm_load_ps(p.dx + k), dy = _mm_load_ps(p.dy + k), dz = _mm_load_ps(p.dz + k);
+        __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+        __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+        auto mul = [](__m128 a, __m128 b) { return _mm_mul_ps(a, b); };
+        auto dot = [&](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+            return _mm_add_ps(_mm_add_ps(mul(ax, bx), mul(ay, by)), mul(az, bz));
+        };
+
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+        __m128 px = _mm_sub_ps(mul(dy, e2z), mul(dz, e2y));
+        __m128 py = _mm_sub_ps(mul(dz, e2x), mul(dx, e2z));
+        __m128 pz = _mm_sub_ps(mul(dx, e2y), mul(dy, e2x));
+        __m128 det = dot(e1x, e1y, e1z, px, py, pz);
+        __m128 valid = _mm_cmpgt_ps(det, zero);
+        __m128 detInv = _mm_div_ps(one, det);
+
+        __m128 tx = _mm_sub_ps(_mm_load_ps(p.ox + k), _mm_set1_ps(v0.x));
+        __m128 ty = _mm_sub_ps(_mm_load_ps(p.oy + k), _mm_set1_ps(v0.y));
+        __m128 tz = _mm_sub_ps(_mm_load_ps(p.oz + k), _mm_set1_ps(v0.z));
+        __m128 u = mul(dot(tx, ty, tz, px, py, pz), detInv);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(mul(ty, e1z), mul(tz, e1y));
+        __m128 qy = _mm_sub_ps(mul(tz, e1x), mul(tx, e1z));
+        __m128 qz = _mm_sub_ps(mul(tx, e1y), mul(ty, e1x));
+        __m128 v = mul(dot(dx, dy, dz, qx, qy, qz), detInv);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+        __m128 tHit = mul(dot(e2x, e2y, e2z, qx, qy, qz), detInv);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tHit, _mm_load_ps(p.tMin + k)),
+                                           _mm_cmplt_ps(tHit, _mm_load_ps(p.tMax + k))));
+        _mm_storeu_ps(t + k, tHit);
+        hit |= _mm_movemask_ps(valid) << k;
+#else
+        for (int i = k; i < k + 4; ++i) {
+            Vector3f dir = p.direction(i);
+            Vector3f pvec = crossProduct(dir, e2);
+            float det = dotProduct(e1, pvec);
+            if (det <= 0)
+                continue;
+            float detInv = 1.f / det;
+            Vector3f tvec = p.origin(i) - v0;
+            float u = dotProduct(tvec, pvec) * detInv;
+            if (u < 0 || u > 1)
+                continue;
+            Vector3f qvec = crossProduct(tvec, e1);
+            float v = dotProduct(dir, qvec) * detInv;
+            if (v < 0 || u + v > 1)
+                continue;
+            t[i] = dotProduct(e2, qvec) * detInv;
+            if (t[i] >= p.tMin[i] && t[i] < p.tMax[i])
+                hit |= 1 << i;
+        }
+#endif
+    }
+    return hit & mask;
+}
+
+#endif //RAYTRACING_RAYPACKET_H
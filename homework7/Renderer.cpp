@@ -7,27 +7,242 @@
 #include "Renderer.hpp"
 #include <future>
 #include <mutex>
-std::mutex mtx;
-int progress = 0;
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+
+// Per-worker tile queue. The owner takes tiles from the back, idle workers
+// steal from the front so they grab work far from what the owner renders.
+class TileQueue
+{
+public:
+    void push(const Tile& tile)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tiles.push_back(tile);
+    }
+
+    bool pop(Tile& tile)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (tiles.empty())
+            return false;
+        tile = tiles.back();
+        tiles.pop_back();
+        return true;
+    }
+
+    bool steal(Tile& tile)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (tiles.empty())
+            return false;
+        tile = tiles.front();
+        tiles.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mtx;
+    std::deque<Tile> tiles;
+};
+
+// Render threads kept alive for a whole Render call. Each run deals the
+// tiles of one pass round robin into per-worker queues; a worker that runs
+// dry steals from the others.
+class TilePool
+{
+public:
+    explicit TilePool(int nThreads) : queues(nThreads)
+    {
+        for (int i = 0; i < nThreads; ++i) {
+            threads.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ~TilePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // Renders every tile and returns once all of them are done
+    void run(const std::vector<Tile>& tiles, const std::function<void(const Tile&)>& renderTile)
+    {
+        for (size_t t = 0; t < tiles.size(); ++t) {
+            queues[t % queues.size()].push(tiles[t]);
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        job = &renderTile;
+        busy = int(threads.size());
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [&] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    void work(int id)
+    {
+        int seen = 0;
+        while (true) {
+            const std::function<void(const Tile&)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [&] { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+                task = job;
+            }
+            Tile tile;
+            while (queues[id].pop(tile) || steal(id, tile)) {
+                (*task)(tile);
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--busy == 0)
+                done.notify_one();
+        }
+    }
+
+    bool steal(int id, Tile& tile)
+    {
+        int n = int(queues.size());
+        for (int k = 1; k < n; ++k) {
+            if (queues[(id + k) % n].steal(tile))
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<TileQueue> queues;
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable wake, done;
+    // The pass being rendered, counted by generation, and the workers still
+    // busy with it
+    const std::function<void(const Tile&)>* job = nullptr;
+    int generation = 0;
+    int busy = 0;
+    bool stop = false;
+};
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// Gamma applied when the framebuffer is written out
+const float displayGamma = 0.6f;
+
+// Tiles of tileSize x tileSize pixels covering the image, clipped at its
+// right and bottom edges
+std::vector<Tile> Renderer::imageTiles(const Scene& scene) const
+{
+    std::vector<Tile> tiles;
+    for (int y0 = 0; y0 < scene.height; y0 += tileSize) {
+        for (int x0 = 0; x0 < scene.width; x0 += tileSize) {
+            tiles.push_back({ x0, y0, std::min(x0 + tileSize, scene.width),
+                              std::min(y0 + tileSize, scene.height) });
+        }
+    }
+    return tiles;
+}
+
+// Renders the given tiles once on the threads of pool, with a progress bar
+void Renderer::forEachTile(TilePool& pool, const std::vector<Tile>& tiles,
+                           const std::function<void(int, int, int, int)>& renderTile) const
+{
+    int nTiles = int(tiles.size());
+    std::atomic<int> tilesDone(0);
+    std::atomic<int> progressShown(-1);
+    pool.run(tiles, [&](const Tile& tile) {
+        renderTile(tile.x0, tile.y0, tile.x1, tile.y1);
+        // Only the worker that moves the bar to a new percent prints it
+        int percent = 100 * (tilesDone.fetch_add(1) + 1) / nTiles;
+        int shown = progressShown.load();
+        while (percent > shown) {
+            if (progressShown.compare_exchange_weak(shown, percent)) {
+                UpdateProgress(percent / 100.f);
+                break;
+            }
+        }
+    });
+}
+
+Ray Renderer::primaryRay(const Scene& scene, int i, int j) const
+{
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+
+    // generate primary ray direction
+    float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+        imageAspectRatio * scale;
+    float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+
+    Vector3f dir = normalize(Vector3f(-x, y, 1));
+    return Ray(eye_pos, dir);
+}
+
+// Pixels of a tile that share a ray packet
+const int packetWidth = 4;
+const int packetHeight = RayPacket::size / packetWidth;
+
+// First hits of the primary rays of the tile [x0, x1) x [y0, y1), stored
+// row by row
+void Renderer::primaryHits(const Scene& scene, int x0, int y0, int x1, int y1,
+                           std::vector<Intersection>& hits) const
+{
+    int w = x1 - x0;
+    hits.assign(w * (y1 - y0), Intersection());
+    if (!packets) {
+        for (int j = y0; j < y1; ++j)
+            for (int i = x0; i < x1; ++i)
+                hits[(j - y0) * w + i - x0] = scene.intersect(primaryRay(scene, i, j));
+        return;
+    }
+
+    for (int pj = y0; pj < y1; pj += packetHeight) {
+        for (int pi = x0; pi < x1; pi += packetWidth) {
+            RayPacket packet;
+            int index[RayPacket::size];
+            for (int j = pj; j < std::min(pj + packetHeight, y1); ++j) {
+                for (int i = pi; i < std::min(pi + packetWidth, x1); ++i) {
+                    index[packet.count] = (j - y0) * w + i - x0;
+                    packet.push(primaryRay(scene, i, j));
+                }
+            }
+            Intersection packetHits[RayPacket::size];
+            scene.intersect(packet, packetHits);
+            for (int k = 0; k < packet.count; ++k)
+                hits[index[k]] = packetHits[k];
+        }
+    }
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    // Joined when the render returns
+    TilePool pool(std::max(1u, std::thread::hardware_concurrency()));
 
-    float scale = tan(deg2rad(scene.fov * 0.5));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-    /*int m = 0;*/
+    if (progressive) {
+        RenderProgressive(scene, pool, framebuffer);
+        return;
+    }
 
     // change the spp value to change sample ammount
-    int spp = 16;
     std::cout << "SPP: " << spp << "\n";
     //for (uint32_t j = 0; j < scene.height; ++j) {
     //    for (uint32_t i = 0; i < scene.width; ++i) {
@@ -56,47 +271,142 @@ void Renderer::Render(const Scene& scene)
     //    UpdateProgress(j / (float)scene.height);
     //}
 
-    std::thread th[16];
-    int thHeight = scene.height / 16;
-    auto renderFunc = [&](int startH, int endH) {
-        int m = startH * scene.width;
-        for (uint32_t j = startH; j < endH; ++j) {
-            for (uint32_t i = 0; i < scene.width; ++i) {
-                // generate primary ray direction
-                float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                    imageAspectRatio * scale;
-                float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-                Vector3f dir = normalize(Vector3f(-x, y, 1));
+    forEachTile(pool, imageTiles(scene), [&](int x0, int y0, int x1, int y1) {
+        std::vector<Intersection> hits;
+        primaryHits(scene, x0, y0, x1, y1, hits);
+        for (int j = y0; j < y1; ++j) {
+            for (int i = x0; i < x1; ++i) {
+                Ray ray = primaryRay(scene, i, j);
+                const Intersection& hit = hits[(j - y0) * (x1 - x0) + i - x0];
+                int m = j * scene.width + i;
+                // Seeding by pixel keeps the image independent of scheduling
+                Sampler sampler(m, seed);
                 for (int k = 0; k < spp; k++) {
-                    framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
+                    framebuffer[m] += scene.castRay(ray, hit, sampler) / spp;
                 }
-                m++;
             }
-            mtx.lock();
-            progress++;
-            UpdateProgress(progress / (float)scene.height);
-            mtx.unlock();
         }
-    };
-    for (int i = 0; i < 16; i++) {
-        th[i] = std::thread(renderFunc, i * thHeight, (i + 1) * thHeight);
-    }
-    for (auto& t : th) {
-        t.join();
-    }
+    });
 
     UpdateProgress(1.f);
 
+    saveImage(scene, framebuffer);
+}
+
+// Renders passes of samplesPerPass samples per pixel. After each pass the
+// pixels whose estimated error on screen is below noiseThreshold, or that
+// reached maxSpp, drop out, so later passes go to the noisy pixels only and
+// skip the tiles that have none left.
+void Renderer::RenderProgressive(const Scene& scene, TilePool& pool,
+                                 std::vector<Vector3f>& framebuffer)
+{
+    int nPixels = scene.width * scene.height;
+    std::vector<Sampler> samplers;
+    samplers.reserve(nPixels);
+    for (int m = 0; m < nPixels; ++m) {
+        samplers.emplace_back(m, seed);
+    }
+    // Per pixel radiance sum and moments of its luminance
+    std::vector<Vector3f> sum(nPixels);
+    std::vector<double> lumSum(nPixels, 0.0), lumSum2(nPixels, 0.0);
+    std::vector<int> count(nPixels, 0);
+    std::vector<char> active(nPixels, 1);
+    int nActive = nPixels;
+
+    std::cout << "Progressive: " << samplesPerPass << " SPP per pass, "
+              << minSpp << " to " << maxSpp << " SPP per pixel\n";
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Tile> tiles = imageTiles(scene);
+    // The primary rays go through the pixel centres in every pass, so their
+    // hits are found once up front
+    std::vector<Intersection> hits(nPixels);
+    forEachTile(pool, tiles, [&](int x0, int y0, int x1, int y1) {
+        std::vector<Intersection> tileHits;
+        primaryHits(scene, x0, y0, x1, y1, tileHits);
+        for (int j = y0; j < y1; ++j) {
+            for (int i = x0; i < x1; ++i) {
+                hits[j * scene.width + i] = tileHits[(j - y0) * (x1 - x0) + i - x0];
+            }
+        }
+    });
+    for (int pass = 0; nActive > 0; ++pass) {
+        forEachTile(pool, tiles, [&](int x0, int y0, int x1, int y1) {
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    int m = j * scene.width + i;
+                    if (!active[m])
+                        continue;
+                    Ray ray = primaryRay(scene, i, j);
+                    // The last pass of a pixel stops at maxSpp
+                    int n = std::min(samplesPerPass, maxSpp - count[m]);
+                    for (int k = 0; k < n; k++) {
+                        Vector3f L = scene.castRay(ray, hits[m], samplers[m]);
+                        double lum = 0.2126 * L.x + 0.7152 * L.y + 0.0722 * L.z;
+                        sum[m] += L;
+                        lumSum[m] += lum;
+                        lumSum2[m] += lum * lum;
+                    }
+                    count[m] += n;
+                }
+            }
+        });
+
+        nActive = 0;
+        for (int m = 0; m < nPixels; ++m) {
+            if (!active[m])
+                continue;
+            int n = count[m];
+            framebuffer[m] = sum[m] / n;
+            bool done = n >= maxSpp;
+            // The variance needs two samples at least
+            if (!done && n >= std::max(minSpp, 2)) {
+                // Standard error of the mean, pushed through the display gamma
+                double mean = lumSum[m] / n;
+                double variance = std::max(0.0, (lumSum2[m] - n * mean * mean) / (n - 1));
+                double error = std::sqrt(variance / n);
+                double screenError = displayGamma * error / std::pow(std::max(mean, 1e-4), 1.0 - displayGamma);
+                done = screenError <= noiseThreshold;
+            }
+            if (done)
+                active[m] = 0;
+            else
+                nActive++;
+        }
+
+        // Tiles with pixels still to sample
+        std::vector<Tile> activeTiles;
+        for (const Tile& tile : tiles) {
+            bool any = false;
+            for (int j = tile.y0; j < tile.y1 && !any; ++j) {
+                for (int i = tile.x0; i < tile.x1 && !any; ++i) {
+                    any = active[j * scene.width + i];
+                }
+            }
+            if (any)
+                activeTiles.push_back(tile);
+        }
+        tiles.swap(activeTiles);
+
+        saveImage(scene, framebuffer);
+        float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "\nPass " << pass + 1 << ": " << nActive << " pixels left, "
+                  << elapsed << " s\n";
+        if (timeBudget > 0 && elapsed >= timeBudget)
+            break;
+    }
+}
+
+void Renderer::saveImage(const Scene& scene, const std::vector<Vector3f>& framebuffer) const
+{
     // save framebuffer to file
     FILE* fp = fopen("binary.ppm", "wb");
     (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
     for (auto i = 0; i < scene.height * scene.width; ++i) {
         static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), displayGamma));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), displayGamma));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), displayGamma));
         fwrite(color, 1, 3, fp);
     }
-    fclose(fp);    
+    fclose(fp);
 }
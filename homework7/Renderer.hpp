@@ -2,6 +2,7 @@
 // Created by goksu on 2/25/20.
 //
 #include "Scene.hpp"
+#include <functional>
 
 #pragma once
 struct hit_payload
@@ -12,10 +13,49 @@ struct hit_payload
     Object* hit_obj;
 };
 
+// Pixels [x0, x1) x [y0, y1) of the image, rendered by one thread
+struct Tile
+{
+    int x0, y0, x1, y1;
+};
+
+class TilePool;
+
 class Renderer
 {
 public:
     void Render(const Scene& scene);
 
+    // Edge length in pixels of the tiles handed to the render threads
+    int tileSize = 16;
+    // Base seed of the per-pixel random sequences
+    uint64_t seed = 0;
+
+    // Samples per pixel when not progressive
+    int spp = 16;
+
+    // Primary rays do not depend on the sample, so they are traced once per
+    // pixel, in packets of RayPacket::size neighbouring pixels when enabled
+    bool packets = true;
+
+    // Progressive mode accumulates passes of samplesPerPass samples and stops
+    // sampling a pixel once it has maxSpp samples, or minSpp samples and a
+    // noise estimate below noiseThreshold (in 0..1 display units). The render
+    // also stops after timeBudget seconds, if it is positive.
+    bool progressive = false;
+    int samplesPerPass = 4;
+    int minSpp = 16;
+    int maxSpp = 1024;
+    float noiseThreshold = 0.01f;
+    float timeBudget = 0;
+
 private:
+    void RenderProgressive(const Scene& scene, TilePool& pool, std::vector<Vector3f>& framebuffer);
+    std::vector<Tile> imageTiles(const Scene& scene) const;
+    void forEachTile(TilePool& pool, const std::vector<Tile>& tiles,
+                     const std::function<void(int, int, int, int)>& renderTile) const;
+    Ray primaryRay(const Scene& scene, int i, int j) const;
+    void primaryHits(const Scene& scene, int x0, int y0, int x1, int y1,
+                     std::vector<Intersection>& hits) const;
+    void saveImage(const Scene& scene, const std::vector<Vector3f>& framebuffer) const;
 };
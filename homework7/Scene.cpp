@@ -7,7 +7,20 @@
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, maxPrimsInNode, splitMethod);
+
+    // Emitters are picked by area when sampling lights
+    std::vector<float> areas;
+    emitters.clear();
+    emit_area_sum = 0;
+    for (Object* obj : objects) {
+        if (obj->hasEmit()) {
+            emitters.push_back(obj);
+            areas.push_back(obj->getArea());
+            emit_area_sum += obj->getArea();
+        }
+    }
+    lightDistribution = AliasTable(areas);
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,25 +28,33 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const
+void Scene::intersect(RayPacket &packet, Intersection *hits) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    this->bvh->Intersect(packet, packet.mask(), hits);
+}
+
+bool Scene::intersectP(const Ray &ray) const
+{
+    return this->bvh->IntersectP(ray);
+}
+
+void Scene::sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const
+{
+    float u1 = sampler.get_float(), u2 = sampler.get_float();
+    int k = lightDistribution.sample(u1, u2);
+    if (k < 0) {
+        // No emitters, there is nothing to sample
+        pdf = 0;
+        return;
     }
+    emitters[k]->Sample(pos, pdf, sampler);
+    // Objects are picked by area, so the pdf is the same over all emitters
+    pdf = 1.0f / emit_area_sum;
+}
+
+float Scene::pdfLight(const Intersection &pos) const
+{
+    return 1.0f / emit_area_sum;
 }
 
 bool Scene::trace(
@@ -57,50 +78,92 @@ bool Scene::trace(
     return (*hitObject != nullptr);
 }
 
-Vector3f Scene::shade(Intersection& intersection, Vector3f wo) const {
+// Power heuristic weight of a sample drawn with pdf fPdf, when gPdf is the
+// pdf the other strategy would have drawn it with
+static float powerHeuristic(float fPdf, float gPdf)
+{
+    float f = fPdf * fPdf, g = gPdf * gPdf;
+    return f / (f + g);
+}
+
+Vector3f Scene::shade(Intersection& intersection, Vector3f wo, Sampler &sampler) const {
     if (intersection.obj->hasEmit()) {
         return intersection.emit;
     }
 
-    Intersection light;
-    float pdf;
-    sampleLight(light, pdf);
-    Vector3f obj2Light = light.coords - intersection.coords;
-    Ray ray(intersection.coords, obj2Light.normalized());
-    Intersection inter = intersect(ray);
-    Vector3f Ldir;
-    if (inter.distance + 0.001 > obj2Light.norm()) {
-        Vector3f fr = intersection.m->eval(-obj2Light.normalized(), wo, intersection.normal);
-        float costheta = std::max(0.f, dotProduct(obj2Light.normalized(), intersection.normal));
-        float costheta1 = std::max(0.f, dotProduct(-obj2Light.normalized(), light.normal));
-        Ldir = light.emit * fr * costheta * costheta1 / dotProduct(obj2Light, obj2Light) / pdf;
-    }
+    // Walk the path iteratively, carrying the product of fr * cos / pdf of
+    // all previous bounces in throughput. Emitters are reached both by light
+    // sampling and by BSDF sampling, and the two are combined with MIS.
+    Vector3f L;
+    Vector3f throughput(1.0f);
+    Intersection isect = intersection;
+    for (int bounce = 0; bounce < maxDepth; ++bounce) {
+        Intersection light;
+        float pdf;
+        sampleLight(light, pdf, sampler);
+        Vector3f obj2Light = light.coords - isect.coords;
+        Vector3f lightDir = obj2Light.normalized();
+        // Stop short of the sampled point, which lies on the emitter itself
+        Ray ray(isect.coords, lightDir, 0.0, RayEpsilon, obj2Light.norm() - RayEpsilon);
+        float costheta1 = dotProduct(-lightDir, light.normal);
+        if (pdf > 0 && costheta1 > 0 && !intersectP(ray)) {
+            Vector3f fr = isect.m->eval(-lightDir, wo, isect.normal);
+            float costheta = std::max(0.f, dotProduct(lightDir, isect.normal));
+            // Light pdf is per area, convert it to solid angle for the weight
+            float dist2 = dotProduct(obj2Light, obj2Light);
+            float lightPdf = pdf * dist2 / costheta1;
+            float bsdfPdf = isect.m->pdf(-wo, lightDir, isect.normal);
+            float weight = powerHeuristic(lightPdf, bsdfPdf);
+            L += throughput * light.emit * fr * costheta * weight / lightPdf;
+        }
+
+        // Paths that already carry little energy are terminated more often
+        float survive = std::min(RussianRoulette,
+                                 std::max(throughput.x, std::max(throughput.y, throughput.z)));
+        if (sampler.get_float() >= survive)
+            break;
 
-    Vector3f Lindir;
-    if (get_random_float() < RussianRoulette) {
-        Vector3f wi = intersection.m->sample(-wo, intersection.normal).normalized();
-        float pdf1 = intersection.m->pdf(-wo, wi, intersection.normal);
-        if (pdf1 > 0.001) {
-            Ray ray1(intersection.coords, wi);
-            Intersection inter1 = intersect(ray1);
-            if (inter1.happened && !inter1.obj->hasEmit()) {
-                Vector3f fr = intersection.m->eval(-wi, wo, intersection.normal);
-                float costheta = std::max(0.f, dotProduct(wi, intersection.normal));
-                Lindir = shade(inter1, -wi) * fr * costheta / pdf1 / RussianRoulette; 
+        Vector3f wi = isect.m->sample(-wo, isect.normal, sampler).normalized();
+        float pdf1 = isect.m->pdf(-wo, wi, isect.normal);
+        if (pdf1 <= 0.001)
+            break;
+        Ray ray1(isect.coords, wi, 0.0, RayEpsilon);
+        Intersection next = intersect(ray1);
+        if (!next.happened)
+            break;
+        Vector3f fr = isect.m->eval(-wi, wo, isect.normal);
+        float costheta = std::max(0.f, dotProduct(wi, isect.normal));
+        throughput = throughput * fr * costheta / pdf1 / survive;
+
+        if (next.obj->hasEmit()) {
+            // BSDF sample landed on a light, weight it against light sampling
+            float costhetaLight = dotProduct(-wi, next.normal);
+            if (costhetaLight > 0) {
+                float lightPdf = pdfLight(next) * next.distance * next.distance / costhetaLight;
+                L += throughput * next.m->getEmission() * powerHeuristic(pdf1, lightPdf);
             }
+            break;
         }
+
+        isect = next;
+        wo = -wi;
     }
 
-    return Ldir + Lindir;
+    return L;
 }
 
 // Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray &ray, int depth) const
+Vector3f Scene::castRay(const Ray &ray, int depth, Sampler &sampler) const
 {
     // TO DO Implement Path Tracing Algorithm here
-    Intersection intersection = Scene::intersect(ray);
+    return castRay(ray, Scene::intersect(ray), sampler);
+}
+
+Vector3f Scene::castRay(const Ray &ray, const Intersection &hit, Sampler &sampler) const
+{
+    Intersection intersection = hit;
     if (intersection.happened) {
-        return shade(intersection, -ray.direction);
+        return shade(intersection, -ray.direction, sampler);
     }
     else {
         return {};
@@ -21,8 +21,16 @@ public:
     int height = 960;
     double fov = 40;
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
-    int maxDepth = 1;
+    // Maximum number of bounces of a path, Russian roulette usually ends it earlier
+    int maxDepth = 32;
+    // Upper bound of the probability that a path survives a bounce
     float RussianRoulette = 0.8;
+    // Rays leaving a surface skip hits closer than this, which are on the
+    // surface itself
+    float RayEpsilon = 0.001f;
+    // BVH built over the scene objects by buildBVH()
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+    int maxPrimsInNode = 4;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -33,10 +41,23 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // Closest hits of all rays of the packet
+    void intersect(RayPacket& packet, Intersection* hits) const;
+    // Whether anything blocks the ray within its interval
+    bool intersectP(const Ray& ray) const;
     BVHAccel *bvh;
+    // Emissive objects and their area weighted distribution, set by buildBVH()
+    std::vector<Object*> emitters;
+    AliasTable lightDistribution;
+    float emit_area_sum = 0;
     void buildBVH();
-    Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    Vector3f castRay(const Ray &ray, int depth, Sampler &sampler) const;
+    // castRay for a ray whose first hit has already been found
+    Vector3f castRay(const Ray &ray, const Intersection &hit, Sampler &sampler) const;
+    // Picks a point on an emitter by area. pdf is 0 when there are none.
+    void sampleLight(Intersection &pos, float &pdf, Sampler &sampler) const;
+    // Area pdf with which sampleLight would pick the point pos on an emitter
+    float pdfLight(const Intersection &pos) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -110,5 +131,5 @@ public:
         // kt = 1 - kr;
     }
 
-    Vector3f shade(Intersection& intersection, Vector3f wo) const;
+    Vector3f shade(Intersection& intersection, Vector3f wo, Sampler &sampler) const;
 };
\ No newline at end of file
@@ -46,7 +46,7 @@ public:
 
         return true;
     }
-    Intersection getIntersection(Ray ray){
+    Intersection getIntersection(const Ray& ray){
         Intersection result;
         result.happened = false;
         Vector3f L = ray.origin - center;
@@ -55,8 +55,10 @@ public:
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        // Nearest root within the ray's interval
+        if (t0 < ray.t_min) t0 = t1;
+        if (t0 < ray.t_min || t0 >= ray.t_max) return result;
+        ray.t_max = t0;
         result.happened=true;
 
         result.coords = Vector3f(ray.origin + ray.direction * t0);
@@ -71,15 +73,17 @@ public:
     { N = normalize(P - center); }
 
     Vector3f evalDiffuseColor(const Vector2f &st)const {
-        return m->getColor();
+        return m->getColorAt(st.x, st.y);
     }
     Bounds3 getBounds(){
         return Bounds3(Vector3f(center.x-radius, center.y-radius, center.z-radius),
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
-    void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
-        Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        // uniform over the area: cos(phi) is uniform in [-1, 1]
+        float theta = 2.0 * M_PI * sampler.get_float(), cosPhi = 1.0f - 2.0f * sampler.get_float();
+        float sinPhi = std::sqrt(std::max(0.f, 1.0f - cosPhi * cosPhi));
+        Vector3f dir(cosPhi, sinPhi*std::cos(theta), sinPhi*std::sin(theta));
         pos.coords = center + radius * dir;
         pos.normal = dir;
         pos.emit = m->getEmission();
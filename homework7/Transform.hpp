@@ -0,0 +1,150 @@
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include "Vector.hpp"
+#include "Bounds3.hpp"
+#include "global.hpp"
+
+// Affine transform stored as the top 3 rows of a 4x4 matrix
+class Transform
+{
+public:
+    float m[3][4];
+
+    Transform()
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = (i == j) ? 1.f : 0.f;
+    }
+
+    static Transform Translate(const Vector3f& d)
+    {
+        Transform t;
+        t.m[0][3] = d.x;
+        t.m[1][3] = d.y;
+        t.m[2][3] = d.z;
+        return t;
+    }
+
+    static Transform Scale(const Vector3f& s)
+    {
+        Transform t;
+        t.m[0][0] = s.x;
+        t.m[1][1] = s.y;
+        t.m[2][2] = s.z;
+        return t;
+    }
+
+    // Rotation of deg degrees around axis
+    static Transform Rotate(float deg, const Vector3f& axis)
+    {
+        Vector3f a = normalize(axis);
+        float theta = deg * M_PI / 180.f;
+        float s = std::sin(theta), c = std::cos(theta);
+        Transform t;
+        t.m[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+        t.m[0][1] = a.x * a.y * (1 - c) - a.z * s;
+        t.m[0][2] = a.x * a.z * (1 - c) + a.y * s;
+        t.m[1][0] = a.x * a.y * (1 - c) + a.z * s;
+        t.m[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+        t.m[1][2] = a.y * a.z * (1 - c) - a.x * s;
+        t.m[2][0] = a.x * a.z * (1 - c) - a.y * s;
+        t.m[2][1] = a.y * a.z * (1 - c) + a.x * s;
+        t.m[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+        return t;
+    }
+
+    Transform operator*(const Transform& t) const
+    {
+        Transform r;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                r.m[i][j] = m[i][0] * t.m[0][j] + m[i][1] * t.m[1][j] +
+                            m[i][2] * t.m[2][j];
+            }
+            r.m[i][3] += m[i][3];
+        }
+        return r;
+    }
+
+    float Determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Whether the linear part is a rotation times a uniform scale, the only
+    // transforms that scale every area by the same factor
+    bool IsSimilarity(float tolerance = 1e-4f) const
+    {
+        Vector3f c[3];
+        for (int j = 0; j < 3; ++j)
+            c[j] = Vector3f(m[0][j], m[1][j], m[2][j]);
+        float s2 = dotProduct(c[0], c[0]);
+        for (int j = 0; j < 3; ++j) {
+            if (std::fabs(dotProduct(c[j], c[j]) - s2) > tolerance * s2 ||
+                std::fabs(dotProduct(c[j], c[(j + 1) % 3])) > tolerance * s2)
+                return false;
+        }
+        return true;
+    }
+
+    Transform Inverse() const
+    {
+        // Invert the linear part by its adjugate, then the translation
+        float invDet = 1.f / Determinant();
+        Transform r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+        for (int i = 0; i < 3; ++i)
+            r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] +
+                          r.m[i][2] * m[2][3]);
+        return r;
+    }
+
+    Vector3f Point(const Vector3f& p) const
+    {
+        return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f Direction(const Vector3f& v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // Normals transform by the inverse transpose, so call this on the
+    // inverse of the transform applied to points
+    Vector3f Normal(const Vector3f& n) const
+    {
+        return Vector3f(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                        m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                        m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+
+    Bounds3 Bounds(const Bounds3& b) const
+    {
+        Bounds3 ret;
+        for (int i = 0; i < 8; ++i) {
+            Vector3f corner((i & 1) ? b.pMax.x : b.pMin.x,
+                            (i & 2) ? b.pMax.y : b.pMin.y,
+                            (i & 4) ? b.pMax.z : b.pMin.z);
+            ret = Union(ret, Point(corner));
+        }
+        return ret;
+    }
+};
+
+#endif //RAYTRACING_TRANSFORM_H
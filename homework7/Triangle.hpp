@@ -44,7 +44,6 @@ class Triangle : public Object
 public:
     Vector3f v0, v1, v2; // vertices A, B ,C , counter-clockwise order
     Vector3f e1, e2;     // 2 edges v1-v0, v2-v0;
-    Vector3f t0, t1, t2; // texture coords
     Vector3f normal;
     float area;
     Material* m;
@@ -61,7 +60,16 @@ public:
     bool intersect(const Ray& ray) override;
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
-    Intersection getIntersection(Ray ray) override;
+    Intersection getIntersection(const Ray& ray) override;
+    void getIntersections(RayPacket& packet, int mask, Intersection* hits) override;
+    Intersection getIntersectionAt(const Ray& ray, float t) override;
+    bool getTriangle(Vector3f& _v0, Vector3f& _e1, Vector3f& _e2) const override
+    {
+        _v0 = v0;
+        _e1 = e1;
+        _e2 = e2;
+        return true;
+    }
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -72,8 +80,8 @@ public:
     }
     Vector3f evalDiffuseColor(const Vector2f&) const override;
     Bounds3 getBounds() override;
-    void Sample(Intersection &pos, float &pdf){
-        float x = std::sqrt(get_random_float()), y = get_random_float();
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        float x = std::sqrt(sampler.get_float()), y = sampler.get_float();
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
         pdf = 1.0f / area;
@@ -89,7 +97,9 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH,
+                 int maxPrimsInNode = 4)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
@@ -132,7 +142,7 @@ public:
             ptrs.push_back(&tri);
             area += tri.area;
         }
-        bvh = new BVHAccel(ptrs);
+        bvh = new BVHAccel(ptrs, maxPrimsInNode, splitMethod);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -184,7 +194,7 @@ public:
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
-    Intersection getIntersection(Ray ray)
+    Intersection getIntersection(const Ray& ray)
     {
         Intersection intersec;
 
@@ -194,9 +204,20 @@ public:
 
         return intersec;
     }
+
+    void getIntersections(RayPacket& packet, int mask, Intersection* hits) override
+    {
+        if (bvh)
+            bvh->Intersect(packet, mask, hits);
+    }
+
+    bool intersectP(const Ray& ray) override
+    {
+        return bvh && bvh->IntersectP(ray);
+    }
     
-    void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        bvh->Sample(pos, pdf, sampler);
         pos.emit = m->getEmission();
     }
     float getArea(){
@@ -229,16 +250,17 @@ inline bool Triangle::intersect(const Ray& ray, float& tnear,
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
-inline Intersection Triangle::getIntersection(Ray ray)
+inline Intersection Triangle::getIntersection(const Ray& ray)
 {
     Intersection inter;
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
     double u, v, t_tmp = 0;
     Vector3f pvec = crossProduct(ray.direction, e2);
     double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
+    // Front faces only, for which the determinant is positive. The test has
+    // no epsilon, since det scales with the triangle's area and a fixed
+    // one would drop every triangle of a small mesh.
+    if (det <= 0)
         return inter;
 
     double det_inv = 1. / det;
@@ -253,20 +275,38 @@ inline Intersection Triangle::getIntersection(Ray ray)
     t_tmp = dotProduct(e2, qvec) * det_inv;
 
     // TODO find ray triangle intersection
-    if (t_tmp < 0)
+    if (t_tmp < ray.t_min || t_tmp >= ray.t_max)
         return inter;
 
+    ray.t_max = t_tmp;
+    return getIntersectionAt(ray, t_tmp);
+}
+
+inline Intersection Triangle::getIntersectionAt(const Ray& ray, float t)
+{
+    Intersection inter;
     inter.happened = true;
-    inter.coords = ray(t_tmp);
+    inter.coords = ray(t);
     inter.normal = normal;
     inter.emit = m->getEmission();
-    inter.distance = t_tmp;
+    inter.distance = t;
     inter.obj = this;
     inter.m = m;
-
     return inter;
 }
 
+inline void Triangle::getIntersections(RayPacket& packet, int mask, Intersection* hits)
+{
+    alignas(16) float t[RayPacket::size];
+    int hit = IntersectTriangle(v0, e1, e2, packet, mask, t);
+    for (int i = 0; hit; ++i, hit >>= 1) {
+        if (!(hit & 1))
+            continue;
+        hits[i] = getIntersectionAt(packet.ray(i), t[i]);
+        packet.tMax[i] = t[i];
+    }
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
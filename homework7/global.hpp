@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cmath>
 #include <random>
+#include <cstdint>
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -28,13 +29,50 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
+// PCG32 random number generator. The renderer gives each pixel its own
+// Sampler, with the pixel index as the sequence, so images are reproducible
+// whichever thread renders the pixel.
+class Sampler
+{
+public:
+    Sampler(uint64_t sequenceIndex = 0, uint64_t seed = 0x853c49e6748fea9bULL)
+    {
+        setSequence(sequenceIndex, seed);
+    }
+
+    void setSequence(uint64_t sequenceIndex, uint64_t seed = 0x853c49e6748fea9bULL)
+    {
+        state = 0u;
+        inc = (sequenceIndex << 1u) | 1u;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next()
+    {
+        uint64_t oldstate = state;
+        state = oldstate * 0x5851f42d4c957f2dULL + inc;
+        uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+        uint32_t rot = (uint32_t)(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    // uniform float in [0, 1)
+    float get_float()
+    {
+        return (next() >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+    uint64_t state, inc;
+};
+
 inline float get_random_float()
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    static thread_local Sampler sampler(std::random_device{}());
 
-    return dist(rng);
+    return sampler.get_float();
 }
 
 inline void UpdateProgress(float progress)
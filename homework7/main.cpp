@@ -2,16 +2,63 @@
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Sphere.hpp"
+#include "Instance.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstdlib>
+#include <string>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
 // function().
+//
+// Options:
+//   --instances     place copies of the bunny on top of the two boxes, as
+//                   instances of one mesh under the scene BVH
+//   --microfacet    give the tall box the rough MICROFACET material
+//   --spp n         samples per pixel of a regular render
+//   --progressive   sample adaptively until the noise estimate is low,
+//                   in passes of --pass-spp n samples, tuned by
+//                   --min-spp n, --max-spp n, --noise t and --time seconds
+//   --no-packets    trace primary rays one by one instead of in SSE packets
 int main(int argc, char** argv)
 {
+    Renderer r;
+    bool instances = false, microfacet = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--instances")
+            instances = true;
+        else if (arg == "--microfacet")
+            microfacet = true;
+        else if (arg == "--spp" && hasValue)
+            r.spp = std::atoi(argv[++i]);
+        else if (arg == "--progressive")
+            r.progressive = true;
+        else if (arg == "--pass-spp" && hasValue)
+            r.samplesPerPass = std::atoi(argv[++i]);
+        else if (arg == "--min-spp" && hasValue)
+            r.minSpp = std::atoi(argv[++i]);
+        else if (arg == "--max-spp" && hasValue)
+            r.maxSpp = std::atoi(argv[++i]);
+        else if (arg == "--noise" && hasValue)
+            r.noiseThreshold = std::atof(argv[++i]);
+        else if (arg == "--time" && hasValue)
+            r.timeBudget = std::atof(argv[++i]);
+        else if (arg == "--no-packets")
+            r.packets = false;
+        else {
+            std::cerr << "Unknown or incomplete option " << arg << "\n";
+            return 1;
+        }
+    }
+    if (r.spp <= 0 || r.samplesPerPass <= 0 || r.minSpp <= 0 || r.maxSpp < r.minSpp) {
+        std::cerr << "--spp, --pass-spp and --min-spp must be positive, --max-spp at least --min-spp\n";
+        return 1;
+    }
 
     // Change the definition here to change resolution
     Scene scene(784, 784);
@@ -33,7 +80,7 @@ int main(int argc, char** argv)
 
     MeshTriangle floor("../models/cornellbox/floor.obj", white);
     MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
+    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", microfacet ? whiteM : white);
     MeshTriangle left("../models/cornellbox/left.obj", red);
     MeshTriangle right("../models/cornellbox/right.obj", green);
     MeshTriangle light_("../models/cornellbox/light.obj", light);
@@ -45,9 +92,24 @@ int main(int argc, char** argv)
     scene.Add(&right);
     scene.Add(&light_);
 
-    scene.buildBVH();
+    // One bunny mesh shared by all instances, scaled up from its unit size
+    // and moved so that it stands on the box tops
+    std::unique_ptr<MeshTriangle> bunny;
+    std::vector<std::unique_ptr<Instance>> bunnies;
+    if (instances) {
+        bunny = std::make_unique<MeshTriangle>("../models/bunny/bunny.obj", white);
+        const float scale = 800, base = -0.0333f * scale;
+        bunnies.push_back(std::make_unique<Instance>(bunny.get(),
+            Transform::Translate(Vector3f(165, 165 + base, 150)) *
+            Transform::Rotate(200, Vector3f(0, 1, 0)) * Transform::Scale(Vector3f(scale))));
+        bunnies.push_back(std::make_unique<Instance>(bunny.get(),
+            Transform::Translate(Vector3f(370, 330 + base, 330)) *
+            Transform::Rotate(160, Vector3f(0, 1, 0)) * Transform::Scale(Vector3f(scale))));
+        for (auto& b : bunnies)
+            scene.Add(b.get());
+    }
 
-    Renderer r;
+    scene.buildBVH();
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);